@@ -0,0 +1,459 @@
+#include<iostream>
+#include<fstream>
+#include<string>
+#include<vector>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<cmath>
+#include<algorithm>
+
+#include "src/value.hpp"
+#include "src/tape.hpp"
+#include "src/module.hpp"
+#include "src/utils.hpp"
+#include "src/trainer.hpp"
+#include "src/plan.hpp"
+#include "src/optimizer.hpp"
+#include "src/checkpoint.hpp"
+#include "src/bench.hpp"
+
+// Sum of width independent chains of depth alternating mul/add ops each
+Value<double> make_graph(const size_t& depth, const size_t& width)
+{
+    Value<double> root(0.0);
+    for (size_t w=0; w<width; ++w)
+    {
+        Value<double> x(0.5);
+        for (size_t d=0; d<depth; ++d)
+            x = (d % 2) ? x + 0.1 : x * 1.01;
+        root = root + x;
+    }
+    return root;
+}
+
+std::vector<std::vector<double>> random_rows(const size_t& rows, const size_t& cols)
+{
+    std::vector<std::vector<double>> rval(rows, std::vector<double>(cols));
+    for (auto& r : rval)
+        for (auto& v : r)
+            v = get_random_number(-0.5, 0.5);
+    return rval;
+}
+
+std::vector<std::vector<double>> one_hot_rows(const size_t& rows, const size_t& classes)
+{
+    std::vector<std::vector<double>> rval(rows, std::vector<double>(classes, 0.0));
+    for (size_t i=0; i<rows; ++i)
+        rval[i][i % classes] = 1.0;
+    return rval;
+}
+
+void bench_value_ops(BenchSuite& suite)
+{
+    const size_t n = 100000;
+    suite.run("value_ops", "n=100000", n, [&]()
+    {
+        Value<double> x(1.0);
+        Value<double> y(0.5);
+        for (size_t i=0; i<n/4; ++i)
+        {
+            auto a = x + y;
+            auto b = a * y;
+            auto c = pow(b, 2.0);
+            do_not_optimise(c.relu().get_data());
+        }
+    });
+
+    suite.run("value_ops_no_grad", "n=100000", n, [&]()
+    {
+        NoGradGuard guard;
+        Value<double> x(1.0);
+        Value<double> y(0.5);
+        for (size_t i=0; i<n/4; ++i)
+        {
+            auto a = x + y;
+            auto b = a * y;
+            auto c = pow(b, 2.0);
+            do_not_optimise(c.relu().get_data());
+        }
+    });
+}
+
+void bench_graphs(BenchSuite& suite)
+{
+    const std::vector<std::pair<size_t, size_t>> shapes = {{10, 1000}, {100, 100}, {1000, 10}, {10000, 1}};
+    for (auto& s : shapes)
+    {
+        const size_t depth = s.first;
+        const size_t width = s.second;
+        const std::string params = "depth=" + std::to_string(depth) + ",width=" + std::to_string(width);
+        const size_t nodes = 2 * depth * width + width + 1;
+
+        Value<double> root(0.0);
+        suite.run_setup("build_topo", params, nodes, [&](){ root = make_graph(depth, width); }, [&]()
+        {
+            do_not_optimise(root.get_ptr()->build_topo().size());
+        });
+
+        suite.run_setup("backward", params, nodes, [&](){ root = make_graph(depth, width); }, [&]()
+        {
+            root.backward();
+        });
+    }
+}
+
+void bench_modules(BenchSuite& suite)
+{
+    const auto input = random_rows(1, 784).front();
+    const auto target = one_hot_rows(1, 10).front();
+
+    Neuron<double> neuron(784);
+    suite.run("neuron_forward", "in=784", 1, [&](){ do_not_optimise(neuron(input).get_data()); }, 100);
+
+    Value<double> out(0.0);
+    suite.run_setup("neuron_backward", "in=784", 1, [&](){ out = neuron(input); }, [&](){ out.backward(); }, 100);
+
+    Layer<double> layer(784, 30);
+    suite.run("layer_forward", "in=784,out=30", 1, [&](){ do_not_optimise(layer(input).size()); }, 100);
+
+    std::vector<Value<double>> outs;
+    suite.run_setup("layer_backward", "in=784,out=30", 1, [&]()
+    {
+        outs = layer(input);
+        out = outs.front();
+        for (size_t i=1; i<outs.size(); ++i)
+            out = out + outs[i];
+    }, [&](){ out.backward(); }, 100);
+
+    MLP<double> model({784, 30, 10});
+    suite.run("mlp_forward", "sizes=784-30-10", 1, [&](){ do_not_optimise(model(input).size()); }, 100);
+    suite.run("mlp_predict", "sizes=784-30-10", 1, [&](){ do_not_optimise(model.predict(input).size()); }, 100);
+    suite.run_setup("mlp_backward", "sizes=784-30-10", 1, [&](){ out = model.loss(input, target); }, [&](){ out.backward(); }, 100);
+}
+
+void bench_read_mnist(BenchSuite& suite)
+{
+    const size_t rows = 1000;
+    const std::string filename = "bench_mnist_tmp.txt";
+    {
+        std::ofstream file(filename);
+        for (size_t i=0; i<rows; ++i)
+        {
+            for (size_t j=0; j<784; ++j)
+                file << (rand() % 256) << (j+1 < 784 ? " " : "\n");
+        }
+    }
+
+    suite.run("read_mnist", "rows=1000,cols=784", rows, [&](){ do_not_optimise(read_mnist<double>(filename).size()); }, 5);
+    std::remove(filename.c_str());
+}
+
+void bench_training(BenchSuite& suite)
+{
+    const size_t batch = 50;
+    const auto inputs = random_rows(batch, 784);
+    const auto targets = one_hot_rows(batch, 10);
+    const double learning_rate = 0.0001;
+
+    MLP<double> model({784, 30, 10});
+    suite.run("train_step_value", "batch=50,sizes=784-30-10", batch, [&]()
+    {
+        for (size_t i=0; i<batch; ++i)
+            model.loss(inputs[i], targets[i]).backward();
+        model.descend_grad(learning_rate);
+        model.zero_grad();
+    });
+
+    suite.run("train_step_value_batched", "batch=50,sizes=784-30-10", batch, [&]()
+    {
+        std::vector<Value<double>> losses;
+        losses.reserve(batch);
+        for (size_t i=0; i<batch; ++i)
+            losses.push_back(model.loss(inputs[i], targets[i]));
+        backward(losses);
+        model.descend_grad(learning_rate);
+        model.zero_grad();
+    });
+
+    ThreadPool pool;
+    suite.run("train_step_value_parallel", "batch=50,sizes=784-30-10,threads=" + std::to_string(pool.size()), batch, [&]()
+    {
+        std::vector<Value<double>> losses;
+        losses.reserve(batch);
+        for (size_t i=0; i<batch; ++i)
+            losses.push_back(model.loss(inputs[i], targets[i]));
+        backward(losses, pool);
+        model.descend_grad(learning_rate);
+        model.zero_grad();
+    });
+
+    ExecutionPlan<double> plan(model);
+    suite.run("train_step_plan", "batch=50,sizes=784-30-10", batch, [&]()
+    {
+        for (size_t i=0; i<batch; ++i)
+            plan.backward(inputs[i].data(), targets[i].data());
+        model.descend_grad(learning_rate);
+        model.zero_grad();
+    });
+
+    DataParallelTrainer<double> trainer(model);
+    suite.run("train_step_data_parallel", "batch=50,sizes=784-30-10,threads=" + std::to_string(trainer.num_threads()), batch, [&]()
+    {
+        do_not_optimise(trainer.train_batch(inputs, targets, static_cast<size_t>(0), batch, learning_rate));
+    });
+}
+
+// Self-checks of the fast paths against their references, run with --check instead of the benchmarks
+
+// Prints one result line and returns 1 on failure
+size_t report_check(const std::string& name, const bool& ok, const double& error)
+{
+    std::cout << name << ": " << (ok ? "ok" : "FAILED") << ", max error " << error << std::endl;
+    return ok ? 0 : 1;
+}
+
+// Error of got against want relative to scale, the sum of the magnitudes that went into want
+double relative_error(const double& got, const double& want, const double& scale)
+{
+    return std::fabs(got - want) / std::max(scale, 1e-300);
+}
+
+// The dispatched kernels against the scalar loops, over lengths that cover the vector bodies and the tails.
+// Without AVX2 both sides are the same code and this only checks the dispatch
+template <class T>
+size_t check_kernels(const std::string& type, const double& tolerance)
+{
+    const std::vector<size_t> lengths = {0, 1, 3, 7, 8, 9, 15, 16, 17, 31, 64, 1001};
+    double dot_error = 0.0, axpy_error = 0.0;
+    bool relu_ok = true;
+    for (auto n : lengths)
+    {
+        std::vector<T> x(n), y(n), dy(n);
+        for (size_t i=0; i<n; ++i)
+        {
+            x[i] = static_cast<T>(get_random_number(-1.0, 1.0));
+            y[i] = static_cast<T>(get_random_number(-1.0, 1.0));
+            dy[i] = static_cast<T>(get_random_number(-1.0, 1.0));
+        }
+
+        double scale = 0.0;
+        for (size_t i=0; i<n; ++i)
+            scale += std::fabs(static_cast<double>(x[i]) * static_cast<double>(y[i]));
+        dot_error = std::max(dot_error, relative_error(simd_dot(x.data(), y.data(), n), scalar_dot(x.data(), y.data(), n), scale));
+
+        std::vector<T> a = y, b = y;
+        simd_axpy(static_cast<T>(0.75), x.data(), a.data(), n);
+        scalar_axpy(static_cast<T>(0.75), x.data(), b.data(), n);
+        for (size_t i=0; i<n; ++i)
+            axpy_error = std::max(axpy_error, relative_error(a[i], b[i], std::fabs(0.75 * x[i]) + std::fabs(y[i])));
+
+        std::vector<T> r1(n), r2(n);
+        simd_relu(x.data(), r1.data(), n);
+        scalar_relu(x.data(), r2.data(), n);
+        relu_ok = relu_ok && std::equal(r1.begin(), r1.end(), r2.begin());
+        r1 = y;
+        r2 = y;
+        simd_relu_backward(x.data(), dy.data(), r1.data(), n);
+        scalar_relu_backward(x.data(), dy.data(), r2.data(), n);
+        relu_ok = relu_ok && std::equal(r1.begin(), r1.end(), r2.begin());
+    }
+
+    size_t failures = 0;
+    failures += report_check("dot<" + type + ">", dot_error <= tolerance, dot_error);
+    failures += report_check("axpy<" + type + ">", axpy_error <= tolerance, axpy_error);
+    failures += report_check("relu<" + type + ">", relu_ok, 0.0);
+    return failures;
+}
+
+size_t check_reduced_kernels()
+{
+    const std::vector<size_t> lengths = {0, 1, 7, 8, 9, 16, 17, 31, 32, 33, 1001};
+    double dot_error = 0.0, axpy_error = 0.0;
+    bool i8_ok = true;
+    for (auto n : lengths)
+    {
+        std::vector<float> x(n), y(n);
+        std::vector<uint16_t> w(n);
+        std::vector<int8_t> qx(n), qw(n);
+        double scale = 0.0;
+        for (size_t i=0; i<n; ++i)
+        {
+            x[i] = static_cast<float>(get_random_number(-1.0, 1.0));
+            y[i] = static_cast<float>(get_random_number(-1.0, 1.0));
+            w[i] = float_to_bf16(static_cast<float>(get_random_number(-1.0, 1.0)));
+            qx[i] = static_cast<int8_t>(rand() % 255 - 127);
+            qw[i] = static_cast<int8_t>(rand() % 255 - 127);
+            scale += std::fabs(x[i] * bf16_to_float(w[i]));
+        }
+        dot_error = std::max(dot_error, relative_error(simd_dot_bf16(x.data(), w.data(), n), scalar_dot_bf16(x.data(), w.data(), n), scale));
+        i8_ok = i8_ok && simd_dot_i8(qx.data(), qw.data(), n) == scalar_dot_i8(qx.data(), qw.data(), n);
+
+        std::vector<float> a = y, b = y;
+        simd_axpy_bf16(0.75f, w.data(), a.data(), n);
+        scalar_axpy_bf16(0.75f, w.data(), b.data(), n);
+        for (size_t i=0; i<n; ++i)
+            axpy_error = std::max(axpy_error, relative_error(a[i], b[i], std::fabs(0.75f * bf16_to_float(w[i])) + std::fabs(y[i])));
+    }
+
+    size_t failures = 0;
+    failures += report_check("dot_bf16", dot_error <= 1e-5, dot_error);
+    failures += report_check("axpy_bf16", axpy_error <= 1e-6, axpy_error);
+    failures += report_check("dot_i8", i8_ok, 0.0);
+    return failures;
+}
+
+// The wavefront backward against the sequential one, which it must match bit for bit. The neurons read
+// the plain input, so they share no parents and are wide enough for the pool to be used
+size_t check_parallel_backward()
+{
+    std::vector<Neuron<double>> neurons;
+    for (size_t k=0; k<512; ++k)
+        neurons.emplace_back(784);
+    std::vector<double> input(784);
+    for (auto& v : input)
+        v = get_random_number(-0.5, 0.5);
+
+    auto take_grads = [&]()
+    {
+        std::vector<double> rval;
+        for (auto& n : neurons)
+            for (auto& p : n.get_parameters())
+            {
+                rval.push_back(p->get_grad());
+                p->get_grad() = 0.0;
+            }
+        return rval;
+    };
+
+    std::vector<Value<double>> roots;
+    for (auto& n : neurons)
+        roots.push_back(n(input));
+    backward(roots);
+    const auto serial = take_grads();
+
+    size_t failures = 0;
+    for (size_t threads : {2, 4})
+    {
+        ThreadPool pool(threads);
+        roots.clear();
+        for (auto& n : neurons)
+            roots.push_back(n(input));
+        backward(roots, pool);
+        const auto parallel = take_grads();
+
+        double error = 0.0;
+        for (size_t i=0; i<serial.size(); ++i)
+            error = std::max(error, std::fabs(serial[i] - parallel[i]));
+        const bool ok = std::memcmp(serial.data(), parallel.data(), serial.size() * sizeof(double)) == 0;
+        failures += report_check("backward threads=" + std::to_string(threads), ok, error);
+    }
+    return failures;
+}
+
+// A checkpoint with Adam state, read back both in place and into existing objects
+size_t check_checkpoint()
+{
+    const std::string filename = "bench_check_tmp.ckpt";
+    MLP<double> model({20, 10, 5});
+    Adam<double> adam(model.get_buffer());
+    for (size_t k=0; k<model.num_parameters(); ++k)
+        model.get_buffer().grad()[k] = get_random_number(-1.0, 1.0);
+    adam.step();
+    save_checkpoint(filename, model, &adam);
+
+    const size_t n = model.num_parameters();
+    bool ok = true;
+    {
+        MLP<double> copy({20, 10, 5});
+        Adam<double> copy_adam(copy.get_buffer());
+        Checkpoint<double> checkpoint(filename);
+        checkpoint.load_into(copy);
+        checkpoint.load_into(copy_adam);
+        ok = ok && std::memcmp(copy.get_buffer().data(), model.get_buffer().data(), n * sizeof(double)) == 0;
+        ok = ok && copy_adam.get_steps() == adam.get_steps();
+        for (size_t i=0; i<adam.get_state().size(); ++i)
+            ok = ok && *copy_adam.get_state()[i] == *adam.get_state()[i];
+
+        auto mapped = Checkpoint<double>(filename).make_model();
+        ok = ok && mapped->get_sizes() == model.get_sizes();
+        ok = ok && std::memcmp(mapped->get_buffer().data(), model.get_buffer().data(), n * sizeof(double)) == 0;
+    }
+    std::remove(filename.c_str());
+    return report_check("checkpoint round trip", ok, 0.0);
+}
+
+size_t run_checks()
+{
+    std::cout << "AVX2 and FMA: " << (cpu_has_avx2_fma() ? "yes" : "no") << std::endl;
+    size_t failures = 0;
+    failures += check_kernels<double>("double", 1e-14);
+    failures += check_kernels<float>("float", 1e-6);
+    failures += check_reduced_kernels();
+    failures += check_parallel_backward();
+    failures += check_checkpoint();
+    std::cout << (failures ? std::to_string(failures) + " checks failed" : "All checks passed") << std::endl;
+    return failures;
+}
+
+// Usage: bench.o [--filter NAME] [--repeats N] [--csv FILE] [--json FILE], or bench.o --check to run the
+// self-checks instead. Writes CSV to stdout if no file is given
+int main(int argc, char** argv)
+{
+    srand(0);
+
+    if (argc == 2 && std::string(argv[1]) == "--check")
+        return run_checks() ? 1 : 0;
+
+    std::string filter, csv, json;
+    size_t repeats = 10;
+    for (int i=1; i<argc; i+=2)
+    {
+        const std::string arg = argv[i];
+        if (arg != "--filter" && arg != "--repeats" && arg != "--csv" && arg != "--json")
+        {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+        if (i+1 >= argc)
+        {
+            std::cerr << "Missing value for option: " << arg << std::endl;
+            return 1;
+        }
+
+        const std::string value = argv[i+1];
+        if (arg == "--filter")
+            filter = value;
+        else if (arg == "--repeats")
+        {
+            // stoul accepts trailing junk and wraps negative numbers, so check the whole value is digits
+            if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos
+                || value.size() > 9 || std::stoul(value) == 0)
+            {
+                std::cerr << "Invalid value for option: " << arg << " " << value << std::endl;
+                return 1;
+            }
+            repeats = std::stoul(value);
+        }
+        else if (arg == "--csv")
+            csv = value;
+        else
+            json = value;
+    }
+
+    BenchSuite suite(filter, repeats);
+    bench_value_ops(suite);
+    bench_graphs(suite);
+    bench_modules(suite);
+    bench_read_mnist(suite);
+    bench_training(suite);
+
+    if (!csv.empty())
+        suite.write_file(csv);
+    if (!json.empty())
+        suite.write_file(json);
+    if (csv.empty() && json.empty())
+        suite.write_csv(std::cout);
+
+    return 0;
+}
@@ -1,11 +1,18 @@
-
 #include<iostream>
 #include<cstdlib>
 #include<tuple>
+#include<chrono>
 
 #include "src/value.hpp"
+#include "src/tape.hpp"
 #include "src/module.hpp"
 #include "src/utils.hpp"
+#include "src/trainer.hpp"
+#include "src/plan.hpp"
+#include "src/optimizer.hpp"
+#include "src/checkpoint.hpp"
+#include "src/quantize.hpp"
+#include "src/graph_passes.hpp"
 
 void sanity_check()
 {
@@ -46,7 +53,331 @@ void MLP_test()
     }
 }
 
+void MLP_tape_test()
+{
+    MLP<double> model({5, 5, 5, 5});
+
+    std::vector<double> input = {4.7, 5.0, 5.2, 5.4, 5.6};
+    std::vector<double> target = {1, 0, 0, 0, 0};
+
+    Tape<double> tape;
+    for (size_t i=0; i<50; ++i)
+    {
+        tape.clear();
+        auto loss = model.loss(tape, input, target);
+        loss.backward();
+        model.descend_grad();
+        model.zero_grad();
+        std::cout << "Loss: " << loss << " | Tape size: " << tape.size() << "\n";
+    }
+}
+
+
+// Trains from a background DataLoader streaming the raw IDX files, instead of preloaded vectors
+void train_from_loader()
+{
+    IdxStream<double> train_set("data/mnist/train-images-idx3-ubyte", "data/mnist/train-labels-idx1-ubyte");
+    DataLoader<double> loader(train_set, 50);
 
+    MLP<double> model({784, 30, 10});
+    DataParallelTrainer<double> trainer(model);
+    for (int epoch=0; epoch<3; ++epoch)
+    {
+        while (const Batch<double>* batch = loader.next())
+        {
+            double loss = trainer.train_batch(*batch, 0.0001);
+            std::cout << "Loss: " << loss / static_cast<double>(batch->size) << std::endl;
+        }
+        std::cout << "Epoch " << epoch+1 << "/3 complete." << std::endl;
+    }
+}
+
+// Times evaluation through the autograd graph against the no-grad predict path
+void benchmark_evaluate(const MLP<double>& model, const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels)
+{
+    using clock = std::chrono::steady_clock;
+
+    auto start = clock::now();
+    double correct = 0.0;
+    for (size_t i=0; i<test_data.size(); ++i)
+    {
+        auto prediction = model(test_data[i]);
+        auto max_index = std::distance(prediction.begin(), std::max_element(prediction.begin(), prediction.end()));
+        if (test_labels[i][max_index] == 1.0)
+            ++correct;
+    }
+    std::chrono::duration<double> graph_time = clock::now() - start;
+    std::cout << "Graph forward:    " << graph_time.count() << "s, accuracy " << correct / test_data.size() << std::endl;
+
+    start = clock::now();
+    double accuracy = evaluate_model(model, test_data, test_labels);
+    std::chrono::duration<double> predict_time = clock::now() - start;
+    std::cout << "No-grad forward:  " << predict_time.count() << "s, accuracy " << accuracy << std::endl;
+    std::cout << "Speedup: " << graph_time.count() / predict_time.count() << "x" << std::endl;
+
+    ThreadPool pool;
+    start = clock::now();
+    Evaluation result = evaluate_model(model, test_data, test_labels, pool);
+    std::chrono::duration<double> batched_time = clock::now() - start;
+    std::cout << "Batched forward:  " << batched_time.count() << "s on " << pool.size() << " threads, accuracy "
+              << result.accuracy() << std::endl;
+    std::cout << "Speedup: " << graph_time.count() / batched_time.count() << "x" << std::endl;
+    for (size_t c=0; c<result.num_classes; ++c)
+        std::cout << "Class " << c << " recall: " << result.recall(c) << std::endl;
+}
+
+// Compares one epoch of per-sample SGD run serially against the Hogwild trainer
+void benchmark_hogwild(const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels,
+    const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels)
+{
+    using clock = std::chrono::steady_clock;
+    const double learning_rate = 0.0001;
+    const unsigned seed = 1;
+
+    // Both runs use the same plan-based engine and the same initial weights, so only the threading differs
+    srand(seed);
+    MLP<double> serial_model({784, 30, 10});
+    HogwildTrainer<double> serial_trainer(serial_model, 1);
+    auto start = clock::now();
+    serial_trainer.train_epoch(train_data, train_labels, learning_rate, false);
+    std::chrono::duration<double> serial_time = clock::now() - start;
+    std::cout << "Serial:  " << train_data.size() / serial_time.count() << " samples/s, accuracy "
+              << evaluate_model(serial_model, test_data, test_labels) << std::endl;
+
+    srand(seed);
+    MLP<double> hogwild_model({784, 30, 10});
+    HogwildTrainer<double> trainer(hogwild_model);
+    start = clock::now();
+    trainer.train_epoch(train_data, train_labels, learning_rate, false);
+    std::chrono::duration<double> hogwild_time = clock::now() - start;
+    std::cout << "Hogwild: " << train_data.size() / hogwild_time.count() << " samples/s on " << trainer.num_threads()
+              << " threads, accuracy " << evaluate_model(hogwild_model, test_data, test_labels) << std::endl;
+}
+
+// Rebuilding the tape every sample against replaying a captured plan
+void benchmark_plan(const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels)
+{
+    using clock = std::chrono::steady_clock;
+    MLP<double> model({784, 30, 10});
+
+    Tape<double> tape;
+    double tape_loss = 0.0;
+    auto start = clock::now();
+    for (size_t i=0; i<train_data.size(); ++i)
+    {
+        tape.clear();
+        auto loss = model.loss(tape, train_data[i], train_labels[i]);
+        tape.sweep(loss.get_index());
+        tape_loss += loss.get_data();
+    }
+    std::chrono::duration<double> tape_time = clock::now() - start;
+
+    ExecutionPlan<double> plan(model);
+    double plan_loss = 0.0;
+    start = clock::now();
+    for (size_t i=0; i<train_data.size(); ++i)
+        plan_loss += plan.sweep(train_data[i].data(), train_labels[i].data());
+    std::chrono::duration<double> plan_time = clock::now() - start;
+
+    std::cout << "Tape: " << train_data.size() / tape_time.count() << " samples/s, loss " << tape_loss << std::endl;
+    std::cout << "Plan: " << train_data.size() / plan_time.count() << " samples/s, loss " << plan_loss
+              << " (" << plan.size() << " entries)" << std::endl;
+}
+
+// Per-step profile of the Value training path. Build with make profile for the hooks to be compiled in
+void profile_training(const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels)
+{
+    MLP<double> model({784, 30, 10});
+    Profiler& profiler = Profiler::instance();
+    profiler.set_enabled(true);
+
+    const size_t batch_size = 10;
+    for (size_t step=0; step<3; ++step)
+    {
+        for (size_t i=step*batch_size; i<(step+1)*batch_size; ++i)
+            model.loss(train_data[i], train_labels[i]).backward();
+        model.descend_grad(0.0001);
+        model.zero_grad();
+        profiler.end_step();
+    }
+
+    profiler.set_enabled(false);
+    profiler.write_trace("profile_trace.json");
+}
+
+// One epoch with each update rule, from the same initialisation
+void compare_optimizers(const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels,
+    const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels)
+{
+    const std::vector<std::string> names = {"SGD", "Momentum", "Adam", "AdamW"};
+    for (size_t which=0; which<names.size(); ++which)
+    {
+        srand(0);
+        MLP<double> model({784, 30, 10});
+        DataParallelTrainer<double> trainer(model);
+
+        std::unique_ptr<Optimizer<double>> optimizer;
+        if (which == 0)
+            optimizer = std::make_unique<SGD<double>>(model.get_buffer(), 0.0001);
+        else if (which == 1)
+            optimizer = std::make_unique<SGD<double>>(model.get_buffer(), 0.0001, 0.9);
+        else if (which == 2)
+            optimizer = std::make_unique<Adam<double>>(model.get_buffer(), 0.001);
+        else
+            optimizer = std::make_unique<AdamW<double>>(model.get_buffer(), 0.001, 0.01);
+        trainer.set_optimizer(optimizer.get());
+
+        double loss = trainer.train_epoch(train_data, train_labels, 50, 0.0);
+        std::cout << names[which] << ": loss " << loss << ", accuracy " << evaluate_model(model, test_data, test_labels) << std::endl;
+    }
+}
+
+// Accuracy, throughput and weight memory of the model stored at each precision
+template <class Packed>
+void report_precision(const std::string& name, const Packed& packed, const size_t& bytes,
+    const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels, ThreadPool& pool)
+{
+    using clock = std::chrono::steady_clock;
+
+    auto start = clock::now();
+    Evaluation result = evaluate_packed(packed, test_data, test_labels, pool);
+    std::chrono::duration<double> time = clock::now() - start;
+    std::cout << name << ": accuracy " << result.accuracy() << ", " << test_data.size() / time.count() << " samples/s, "
+              << bytes / 1024 << " KiB" << std::endl;
+}
+
+void compare_precisions(const MLP<double>& model, const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels)
+{
+    ThreadPool pool;
+    const PackedMLP<double> packed(model);
+
+    size_t bytes = 0;
+    for (size_t l=0; l+1<packed.get_sizes().size(); ++l)
+        bytes += (packed.get_weights(l).size() + packed.get_bias(l).size()) * sizeof(double);
+
+    const ReducedMLP<float> reduced_float(packed);
+    const ReducedMLP<bfloat16> reduced_bf16(packed);
+    const QuantizedMLP quantized(packed);
+
+    report_precision("double", packed, bytes, test_data, test_labels, pool);
+    report_precision("float ", reduced_float, reduced_float.num_bytes(), test_data, test_labels, pool);
+    report_precision("bf16  ", reduced_bf16, reduced_bf16.num_bytes(), test_data, test_labels, pool);
+    report_precision("int8  ", quantized, quantized.num_bytes(), test_data, test_labels, pool);
+}
+
+// One epoch of mixed-precision training with float and with bfloat16 working weights, from the same
+// initialisation. Both keep a float master copy and accumulate in float
+template <class W>
+void train_mixed_precision(const std::string& name, const PackedMLP<double>& initial,
+    const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels,
+    const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels, ThreadPool& pool)
+{
+    using clock = std::chrono::steady_clock;
+
+    MixedPrecisionMLP<W> model(initial);
+    typename MixedPrecisionMLP<W>::TrainWorkspace workspace;
+    const size_t batch_size = 50;
+    const size_t size_in = train_data.front().size();
+    const size_t size_out = train_labels.front().size();
+    std::vector<float> inputs, targets;
+
+    double loss = 0.0;
+    auto start = clock::now();
+    for (size_t first=0; first<train_data.size(); first+=batch_size)
+    {
+        const size_t count = std::min(batch_size, train_data.size() - first);
+        inputs.resize(count * size_in);
+        targets.resize(count * size_out);
+        for (size_t b=0; b<count; ++b)
+        {
+            std::copy(train_data[first+b].begin(), train_data[first+b].end(), inputs.begin() + b * size_in);
+            std::copy(train_labels[first+b].begin(), train_labels[first+b].end(), targets.begin() + b * size_out);
+        }
+        loss += model.train_batch(inputs.data(), targets.data(), count, 0.0001f, workspace);
+    }
+    std::chrono::duration<double> time = clock::now() - start;
+    std::cout << name << ": loss " << loss << ", " << time.count() << " s" << std::endl;
+    report_precision(name, model, model.num_bytes(), test_data, test_labels, pool);
+}
+
+void compare_mixed_precision(const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels,
+    const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels)
+{
+    ThreadPool pool;
+    srand(0);
+    const PackedMLP<double> initial(MLP<double>({784, 30, 10}));
+
+    train_mixed_precision<float>("float ", initial, train_data, train_labels, test_data, test_labels, pool);
+    train_mixed_precision<bfloat16>("bf16  ", initial, train_data, train_labels, test_data, test_labels, pool);
+}
+
+// Sensitivity of the predicted class to each input pixel, from the Jacobian computed in forward mode
+void input_sensitivity(const MLP<double>& model, const std::vector<double>& sample)
+{
+    const auto output = model.predict(sample);
+    const size_t predicted = std::max_element(output.begin(), output.end()) - output.begin();
+    const auto jac = jacobian<8>(model, sample);
+
+    std::vector<size_t> order(sample.size());
+    for (size_t i=0; i<order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b){ return std::fabs(jac[predicted][a]) > std::fabs(jac[predicted][b]); });
+
+    std::cout << "Predicted class " << predicted << ", most sensitive pixels:" << std::endl;
+    for (size_t i=0; i<10; ++i)
+        std::cout << "  (" << order[i] / 28 << ", " << order[i] % 28 << "): " << jac[predicted][order[i]] << std::endl;
+}
+
+// Node counts of a graph with a constant subexpression and a repeated one, before and after optimisation
+void graph_passes_demo()
+{
+    auto x = Value<double>(1.5);
+    auto y = Value<double>(-0.5);
+    auto scale = Value<double>::constant(2.0);
+    auto shift = Value<double>::constant(0.25);
+
+    auto k = scale * scale + shift;
+    auto a = (x * y + k).relu();
+    auto b = (y * x + k).relu();
+    auto L = a * b + x * k;
+
+    std::cout << optimize_graph(L) << std::endl;
+    L.backward();
+    std::cout << x << " " << y << std::endl;
+}
+
+// One epoch of the Value graph with the summed squared error against softmax cross-entropy
+void compare_losses(const std::vector<std::vector<double>>& train_data, const std::vector<std::vector<double>>& train_labels,
+    const std::vector<std::vector<double>>& test_data, const std::vector<std::vector<double>>& test_labels)
+{
+    const size_t batch_size = 50;
+    for (size_t which=0; which<2; ++which)
+    {
+        srand(0);
+        MLP<double> model({784, 30, 10});
+        const double learning_rate = which == 0 ? 0.0001 : 0.01;
+
+        double total = 0.0;
+        for (size_t i=0; i<train_data.size(); ++i)
+        {
+            const auto& label = train_labels[i];
+            const size_t cls = std::max_element(label.begin(), label.end()) - label.begin();
+            auto loss = which == 0 ? model.loss(train_data[i], label) : model.cross_entropy(train_data[i], cls);
+            loss.backward();
+            total += loss.get_data();
+
+            if ((i + 1) % batch_size == 0 || i + 1 == train_data.size())
+            {
+                model.descend_grad(learning_rate);
+                model.zero_grad();
+            }
+        }
+
+        const size_t nodes = model.loss(train_data.front(), train_labels.front()).build_topo().size();
+        std::cout << (which == 0 ? "Squared error: " : "Cross-entropy: ") << "loss " << total / train_data.size()
+                  << ", accuracy " << evaluate_model(model, test_data, test_labels) << ", " << nodes << " nodes per sample" << std::endl;
+    }
+}
 
 int main()
 {
@@ -54,44 +385,75 @@ int main()
     
     //sanity_check();
 
+    //graph_passes_demo();
+
     //MLP_test();
 
+    //MLP_tape_test();
+
+    //train_from_loader();
+
     std::cout << "Loading MNIST data..." << std::endl;
-    auto all_data = get_mnist_data<double>();
-    auto& train_data = std::get<0>(all_data);
-    auto& train_labels = std::get<1>(all_data);
-    auto& test_data = std::get<2>(all_data);
-    auto& test_labels = std::get<3>(all_data);
+    bool have_idx = file_exists("data/mnist/train-images-idx3-ubyte") || file_exists("data/mnist/train.f64.cache");
+    std::pair<MnistDataset<double>, MnistDataset<double>> all_data;
+    if (have_idx)
+        all_data = get_mnist_idx_data<double>();
+    else
+    {
+        auto text_data = get_mnist_data<double>();
+        all_data.first = MnistDataset<double>::from_rows(std::get<0>(text_data), std::get<1>(text_data));
+        all_data.second = MnistDataset<double>::from_rows(std::get<2>(text_data), std::get<3>(text_data));
+    }
+    const MnistDataset<double>& train_set = all_data.first;
+    const MnistDataset<double>& test_set = all_data.second;
     std::cout << "Done!" << std::endl;
 
     std::cout << "Creating model..." << std::endl;
     MLP<double> model({784, 30, 10});
     std::cout << "Done!" << std::endl;
 
-    std::cout << "Training model..." << std::endl;
-    int batch_size = 50;
+    DataParallelTrainer<double> trainer(model);
+    std::cout << "Training model on " << trainer.num_threads() << " threads..." << std::endl;
+    size_t batch_size = 50;
     int num_epochs = 3;
-    double running_loss = 0.0;
+    DataLoader<double> loader(train_set, batch_size);
     for (int epoch=0; epoch<num_epochs; ++epoch)
     {
-        for (int i=0; i<train_data.size(); ++i)
+        while (const Batch<double>* batch = loader.next())
         {
-            auto loss = model.loss(train_data[i], train_labels[i]);
-            loss.backward();
-            running_loss += loss.get_data();
-            if ((i+1) % batch_size == 0)
-            {
-                model.descend_grad(0.0001);
-                model.zero_grad();
-                std::cout << "Loss: " << running_loss / static_cast<double>(batch_size) << std::endl;
-                running_loss = 0.0;
-            }
+            double loss = trainer.train_batch(*batch, 0.0001);
+            std::cout << "Loss: " << loss / static_cast<double>(batch->size) << std::endl;
         }
         std::cout << "Epoch " << epoch+1 << "/" << num_epochs << " complete." << std::endl;
     }
     std::cout << "Done!" << std::endl;
 
-    std::cout << "Accuracy: " << evaluate_model(model, test_data, test_labels) << std::endl;
+    ThreadPool pool(trainer.num_threads());
+    std::cout << "Accuracy: " << evaluate_model(model, test_set, pool).accuracy() << std::endl;
+
+    // The demos below take the nested layout
+    //auto train_data = train_set.image_rows(), train_labels = train_set.label_rows();
+    //auto test_data = test_set.image_rows(), test_labels = test_set.label_rows();
+
+    //save_checkpoint("data/model.ckpt", model);
+
+    //benchmark_evaluate(model, test_data, test_labels);
+
+    //benchmark_hogwild(train_data, train_labels, test_data, test_labels);
+
+    //benchmark_plan(train_data, train_labels);
+
+    //profile_training(train_data, train_labels);
+
+    //compare_optimizers(train_data, train_labels, test_data, test_labels);
+
+    //compare_losses(train_data, train_labels, test_data, test_labels);
+
+    //compare_precisions(model, test_data, test_labels);
+
+    //compare_mixed_precision(train_data, train_labels, test_data, test_labels);
+
+    //input_sensitivity(model, test_data.front());
 
 
     return 0;
@@ -0,0 +1,133 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include<iostream>
+#include<fstream>
+#include<string>
+#include<vector>
+#include<chrono>
+#include<algorithm>
+#include<stdexcept>
+
+// Minimal benchmark harness. Each case runs an untimed setup and a timed body a number of times and keeps
+// per-repeat wall times. Results are written as CSV or JSON so runs can be compared across versions
+struct BenchResult
+{
+    std::string name;
+    std::string params;
+    size_t items;       // work items per repeat, e.g. nodes or samples
+    size_t repeats;
+    double min_ns;
+    double median_ns;
+    double mean_ns;
+
+    double ns_per_item() const { return items ? median_ns / static_cast<double>(items) : median_ns; }
+};
+
+// Keeps the compiler from discarding a result
+template <class T>
+inline void do_not_optimise(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class BenchSuite
+{
+private:
+    std::vector<BenchResult> _results;
+    std::string _filter;
+    size_t _repeats;
+
+    static std::string escape(const std::string& s)
+    {
+        std::string rval;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                rval.push_back('\\');
+            rval.push_back(c);
+        }
+        return rval;
+    }
+
+public:
+    BenchSuite(const std::string& filter="", const size_t& repeats=10): _filter{filter}, _repeats{repeats} {}
+
+    const std::vector<BenchResult>& get_results() const { return _results; }
+
+    // Runs setup() then times body(), repeats times. Cases whose name does not contain the filter are skipped
+    template <class Setup, class Body>
+    void run_setup(const std::string& name, const std::string& params, const size_t& items, Setup setup, Body body, size_t repeats=0)
+    {
+        using clock = std::chrono::steady_clock;
+
+        if (!_filter.empty() && name.find(_filter) == std::string::npos)
+            return;
+        if (repeats == 0)
+            repeats = _repeats;
+
+        std::vector<double> times;
+        times.reserve(repeats);
+        for (size_t r=0; r<repeats; ++r)
+        {
+            setup();
+            auto start = clock::now();
+            body();
+            std::chrono::duration<double, std::nano> elapsed = clock::now() - start;
+            times.push_back(elapsed.count());
+        }
+
+        std::sort(times.begin(), times.end());
+        double sum = 0.0;
+        for (auto& t : times)
+            sum += t;
+        BenchResult result{name, params, items, repeats, times.front(), times[times.size() / 2], sum / times.size()};
+        _results.push_back(result);
+
+        std::cerr << name << " [" << params << "] " << result.median_ns / 1e6 << " ms, "
+                  << result.ns_per_item() << " ns/item" << std::endl;
+    }
+
+    // As above with nothing to set up
+    template <class Body>
+    void run(const std::string& name, const std::string& params, const size_t& items, Body body, size_t repeats=0)
+    {
+        run_setup(name, params, items, [](){}, body, repeats);
+    }
+
+    void write_csv(std::ostream& os) const
+    {
+        os << "name,params,items,repeats,min_ns,median_ns,mean_ns,ns_per_item\n";
+        for (auto& r : _results)
+            os << r.name << ",\"" << r.params << "\"," << r.items << "," << r.repeats << "," << r.min_ns << ","
+               << r.median_ns << "," << r.mean_ns << "," << r.ns_per_item() << "\n";
+    }
+
+    void write_json(std::ostream& os) const
+    {
+        os << "{\n  \"benchmarks\": [\n";
+        for (size_t i=0; i<_results.size(); ++i)
+        {
+            const auto& r = _results[i];
+            os << "    {\"name\": \"" << escape(r.name) << "\", \"params\": \"" << escape(r.params)
+               << "\", \"items\": " << r.items << ", \"repeats\": " << r.repeats << ", \"min_ns\": " << r.min_ns
+               << ", \"median_ns\": " << r.median_ns << ", \"mean_ns\": " << r.mean_ns
+               << ", \"ns_per_item\": " << r.ns_per_item() << "}" << (i+1 < _results.size() ? "," : "") << "\n";
+        }
+        os << "  ]\n}\n";
+    }
+
+    void write_file(const std::string& filename) const
+    {
+        std::ofstream file(filename);
+        if (!file.is_open())
+            throw std::runtime_error("Error opening file: " + filename + ".");
+
+        if (filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0)
+            write_json(file);
+        else
+            write_csv(file);
+    }
+};
+
+#endif
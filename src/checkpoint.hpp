@@ -0,0 +1,296 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include<iostream>
+#include<fstream>
+#include<string>
+#include<vector>
+#include<memory>
+#include<cstdint>
+#include<cstring>
+#include<cstdio>
+#include<stdexcept>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<exception>
+#include<utility>
+#include<assert.h>
+
+#include "mapped_file.hpp"
+#include "parameters.hpp"
+#include "module.hpp"
+#include "optimizer.hpp"
+
+// Checkpoint layout, all native-endian:
+//   CheckpointHeader
+//   num_sizes uint64 layer widths, as MLP::get_sizes()
+//   num_parameters values of T, in get_parameters() order
+//   num_state arrays of num_parameters values of T, as Optimizer::get_state()
+// The header and widths are multiples of 8 bytes, so the parameters start at a multiple of 8 bytes and every
+// value after them is aligned for T. That is what using them in place from a mapping needs. The state arrays
+// follow without padding, so for float data with an odd num_parameters they are only 4-byte aligned.
+struct CheckpointHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t value_size;
+    uint32_t num_sizes;
+    uint64_t num_parameters;
+    uint32_t num_state;
+    uint32_t reserved;
+    uint64_t steps;
+};
+
+constexpr uint32_t checkpoint_version = 1;
+
+// Writes to a temporary file first and renames it over filename, so an existing checkpoint is only ever
+// replaced by a complete one
+template <class T>
+void write_checkpoint(const std::string& filename, const std::vector<size_t>& sizes, const T* parameters,
+    const size_t& num_parameters, const std::vector<const T*>& state={}, const size_t& steps=0)
+{
+    const std::string temp = filename + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("Error opening file: " + temp + ".");
+
+        CheckpointHeader header{{'C', 'G', 'C', 'K'}, checkpoint_version, sizeof(T), static_cast<uint32_t>(sizes.size()),
+            num_parameters, static_cast<uint32_t>(state.size()), 0, steps};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(CheckpointHeader));
+
+        std::vector<uint64_t> widths(sizes.begin(), sizes.end());
+        file.write(reinterpret_cast<const char*>(widths.data()), widths.size() * sizeof(uint64_t));
+        file.write(reinterpret_cast<const char*>(parameters), num_parameters * sizeof(T));
+        for (auto& s : state)
+            file.write(reinterpret_cast<const char*>(s), num_parameters * sizeof(T));
+
+        if (!file)
+            throw std::runtime_error("Error writing file: " + temp + ".");
+    }
+    if (std::rename(temp.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Error replacing file: " + filename + ".");
+}
+
+template <class T>
+void save_checkpoint(const std::string& filename, const MLP<T>& model, Optimizer<T>* optimizer=nullptr)
+{
+    std::vector<const T*> state;
+    if (optimizer)
+    {
+        assert(&optimizer->get_buffer() == &model.get_buffer());
+        for (auto s : optimizer->get_state())
+            state.push_back(s->data());
+    }
+    write_checkpoint(filename, model.get_sizes(), model.get_buffer().data(), model.num_parameters(), state,
+        optimizer ? optimizer->get_steps() : 0);
+}
+
+// A checkpoint file, mapped and validated on construction
+template <class T>
+class Checkpoint
+{
+private:
+    std::string _filename;
+    MappedFile _file;
+    CheckpointHeader _header;
+    std::vector<size_t> _sizes;
+    size_t _parameters_offset;
+
+public:
+    Checkpoint(const std::string& filename): _filename{filename}, _file{filename, true}
+    {
+        if (_file.size() < sizeof(CheckpointHeader))
+            throw std::runtime_error("Truncated checkpoint: " + filename + ".");
+        std::memcpy(&_header, _file.data(), sizeof(CheckpointHeader));
+        if (std::memcmp(_header.magic, "CGCK", 4) != 0 || _header.version != checkpoint_version || _header.value_size != sizeof(T))
+            throw std::runtime_error("Incompatible checkpoint: " + filename + ".");
+
+        _parameters_offset = sizeof(CheckpointHeader) + _header.num_sizes * sizeof(uint64_t);
+        const size_t expected = _parameters_offset + (1 + _header.num_state) * _header.num_parameters * sizeof(T);
+        if (_file.size() < expected)
+            throw std::runtime_error("Truncated checkpoint: " + filename + ".");
+
+        for (size_t i=0; i<_header.num_sizes; ++i)
+        {
+            uint64_t width;
+            std::memcpy(&width, _file.data() + sizeof(CheckpointHeader) + i * sizeof(uint64_t), sizeof(uint64_t));
+            _sizes.push_back(width);
+        }
+    }
+
+    // Getters. The value arrays are only available until make_model()
+    const std::vector<size_t>& get_sizes() const { return _sizes; }
+    size_t num_parameters() const { return _header.num_parameters; }
+    size_t num_state() const { return _header.num_state; }
+    size_t get_steps() const { return _header.steps; }
+    const T* parameters() const { return reinterpret_cast<const T*>(_file.data() + _parameters_offset); }
+    const T* state(const size_t& i) const { return parameters() + (1 + i) * _header.num_parameters; }
+
+    // New model whose parameters are used in place from the mapping. Writes during training go to private
+    // copies of the pages touched, never to the file. The checkpoint is left without its mapping
+    std::unique_ptr<MLP<T>> make_model()
+    {
+        auto buffer = std::make_shared<ParameterBuffer<T>>(std::move(_file), _parameters_offset, num_parameters());
+        return std::make_unique<MLP<T>>(_sizes, buffer);
+    }
+
+    // Copies the parameters into an existing model of the same shape
+    void load_into(MLP<T>& model) const
+    {
+        if (!_file.is_open() || model.get_sizes() != _sizes)
+            throw std::runtime_error("Checkpoint does not match the model: " + _filename + ".");
+        std::memcpy(model.get_buffer().data(), parameters(), num_parameters() * sizeof(T));
+    }
+
+    // Restores the step count and state arrays of an optimiser of the same kind
+    void load_into(Optimizer<T>& optimizer) const
+    {
+        auto state = optimizer.get_state();
+        if (!_file.is_open() || state.size() != num_state())
+            throw std::runtime_error("Checkpoint does not match the optimiser: " + _filename + ".");
+        for (size_t i=0; i<state.size(); ++i)
+        {
+            if (state[i]->size() != num_parameters())
+                throw std::runtime_error("Checkpoint does not match the optimiser: " + _filename + ".");
+            std::memcpy(state[i]->data(), this->state(i), num_parameters() * sizeof(T));
+        }
+        optimizer.set_steps(get_steps());
+    }
+};
+
+// Writes checkpoints on a background thread. save() copies the parameters and optimiser state into a staging
+// area and returns; the writer picks up the latest snapshot, so if training outpaces the disk intermediate
+// snapshots are dropped rather than queued
+template <class T>
+class AsyncCheckpointer
+{
+private:
+    std::string _filename;
+    size_t _every;
+
+    struct Snapshot
+    {
+        std::vector<size_t> sizes;
+        std::vector<T> parameters;
+        std::vector<std::vector<T>> state;
+        size_t steps = 0;
+    };
+    Snapshot _pending;
+    Snapshot _writing;
+    bool _has_pending = false;
+    bool _busy = false;
+    bool _stop = false;
+    size_t _written = 0;
+    std::exception_ptr _error;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _idle;
+    std::thread _worker;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            _wake.wait(lock, [&](){ return _stop || _has_pending; });
+            if (!_has_pending)
+                return;
+
+            std::swap(_pending, _writing);
+            _has_pending = false;
+            _busy = true;
+            lock.unlock();
+
+            std::vector<const T*> state;
+            for (auto& s : _writing.state)
+                state.push_back(s.data());
+            std::exception_ptr error;
+            try
+            {
+                write_checkpoint(_filename, _writing.sizes, _writing.parameters.data(), _writing.parameters.size(), state, _writing.steps);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            _busy = false;
+            if (error)
+                _error = error;
+            else
+                ++_written;
+            _idle.notify_all();
+        }
+    }
+
+public:
+    AsyncCheckpointer(const std::string& filename, const size_t& every=1): _filename{filename}, _every{every}
+    {
+        _worker = std::thread(&AsyncCheckpointer::run, this);
+    }
+    // Writes any pending snapshot before returning
+    ~AsyncCheckpointer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _worker.join();
+    }
+
+    AsyncCheckpointer(const AsyncCheckpointer&) = delete;
+    AsyncCheckpointer& operator=(const AsyncCheckpointer&) = delete;
+
+    // Number of checkpoints written so far
+    size_t get_written()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _written;
+    }
+
+    void save(const MLP<T>& model, Optimizer<T>* optimizer=nullptr)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_error)
+            std::rethrow_exception(std::exchange(_error, nullptr));
+
+        _pending.sizes = model.get_sizes();
+        _pending.parameters.assign(model.get_buffer().data(), model.get_buffer().data() + model.num_parameters());
+        _pending.state.clear();
+        _pending.steps = 0;
+        if (optimizer)
+        {
+            for (auto s : optimizer->get_state())
+                _pending.state.push_back(*s);
+            _pending.steps = optimizer->get_steps();
+        }
+        _has_pending = true;
+        lock.unlock();
+        _wake.notify_one();
+    }
+
+    // Saves on every every-th step. Returns whether a snapshot was taken
+    bool on_step(const size_t& step, const MLP<T>& model, Optimizer<T>* optimizer=nullptr)
+    {
+        if (_every == 0 || step % _every != 0)
+            return false;
+        save(model, optimizer);
+        return true;
+    }
+
+    // Blocks until every snapshot taken so far is on disk
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _idle.wait(lock, [&](){ return !_has_pending && !_busy; });
+        if (_error)
+            std::rethrow_exception(std::exchange(_error, nullptr));
+    }
+};
+
+#endif
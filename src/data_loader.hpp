@@ -0,0 +1,174 @@
+#ifndef DATA_LOADER_HPP
+#define DATA_LOADER_HPP
+
+#include<vector>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<random>
+#include<numeric>
+#include<algorithm>
+#include<string>
+#include<stdexcept>
+#include<assert.h>
+
+#include "mnist.hpp"
+
+// A mini-batch in contiguous row-major buffers
+template <class T>
+struct Batch
+{
+    std::vector<T> inputs;       // size * cols
+    std::vector<T> targets;      // size * num_classes, one-hot
+    std::vector<size_t> labels;  // size
+    size_t size = 0;
+    size_t cols = 0;
+    size_t num_classes = 0;
+
+    const T* input(const size_t& i) const { return inputs.data() + i * cols; }
+    const T* target(const size_t& i) const { return targets.data() + i * num_classes; }
+};
+
+// Produces mini-batches on a background thread into a bounded ring of reusable batch buffers, so that
+// reading, normalisation and batch assembly overlap with training. The order is reshuffled every epoch
+// from a seeded generator. Epochs follow each other without a break; next() returns nullptr once at
+// the end of each.
+template <class T>
+class DataLoader
+{
+private:
+    const Dataset<T>& _dataset;
+    size_t _batch_size;
+    size_t _num_classes;
+    bool _shuffle;
+    std::mt19937 _rng;
+
+    // Ring of batches. A batch with size 0 marks the end of an epoch
+    std::vector<Batch<T>> _ring;
+    size_t _head = 0;
+    size_t _tail = 0;
+    size_t _count = 0;
+    bool _holding = false;
+    bool _stop = false;
+    std::mutex _mutex;
+    std::condition_variable _not_full;
+    std::condition_variable _not_empty;
+    std::thread _worker;
+
+    void fill(Batch<T>& batch, const size_t* indices, const size_t& count)
+    {
+        batch.size = count;
+        batch.cols = _dataset.cols();
+        batch.num_classes = _num_classes;
+        batch.inputs.resize(count * batch.cols);
+        batch.targets.assign(count * _num_classes, static_cast<T>(0));
+        batch.labels.resize(count);
+        for (size_t i=0; i<count; ++i)
+        {
+            _dataset.copy_row(indices[i], batch.inputs.data() + i * batch.cols);
+            batch.labels[i] = _dataset.label(indices[i]);
+            batch.targets[i * _num_classes + batch.labels[i]] = static_cast<T>(1);
+        }
+    }
+
+    // Fills the next free slot, false once the loader is stopping
+    bool push(const size_t* indices, const size_t& count)
+    {
+        size_t slot;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _not_full.wait(lock, [&](){ return _stop || _count < _ring.size(); });
+            if (_stop)
+                return false;
+            slot = _tail;
+        }
+
+        // The slot is not visible to the consumer until it is counted, so fill it unlocked
+        fill(_ring[slot], indices, count);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tail = (_tail + 1) % _ring.size();
+            ++_count;
+        }
+        _not_empty.notify_one();
+        return true;
+    }
+
+    void produce()
+    {
+        std::vector<size_t> order(_dataset.size());
+        std::iota(order.begin(), order.end(), static_cast<size_t>(0));
+        while (true)
+        {
+            if (_shuffle)
+                std::shuffle(order.begin(), order.end(), _rng);
+
+            for (size_t start=0; start<order.size(); start+=_batch_size)
+                if (!push(order.data() + start, std::min(_batch_size, order.size() - start)))
+                    return;
+
+            // End of epoch marker
+            if (!push(order.data(), 0))
+                return;
+        }
+    }
+
+public:
+    DataLoader(const Dataset<T>& dataset, const size_t& batch_size, const size_t& num_classes=10,
+        const size_t& capacity=4, const bool& shuffle=true, const unsigned& seed=0):
+    _dataset{dataset}, _batch_size{batch_size}, _num_classes{num_classes}, _shuffle{shuffle}, _rng{seed},
+    _ring(std::max(capacity, static_cast<size_t>(2)))
+    {
+        assert(batch_size > 0);
+
+        // Checked here once, so fill() can set the one-hot targets unchecked
+        for (size_t i=0; i<_dataset.size(); ++i)
+            if (_dataset.label(i) >= _num_classes)
+                throw std::runtime_error("Label " + std::to_string(_dataset.label(i)) + " of row " + std::to_string(i)
+                    + " is out of range for " + std::to_string(_num_classes) + " classes.");
+
+        _worker = std::thread(&DataLoader::produce, this);
+    }
+    ~DataLoader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _not_full.notify_all();
+        _worker.join();
+    }
+
+    DataLoader(const DataLoader&) = delete;
+    DataLoader(DataLoader&&) = delete;
+    DataLoader& operator=(const DataLoader&) = delete;
+    DataLoader& operator=(DataLoader&&) = delete;
+
+    // Next batch of the current epoch, or nullptr at its end. A batch stays valid until the following call
+    const Batch<T>* next()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_holding)
+        {
+            _head = (_head + 1) % _ring.size();
+            --_count;
+            _holding = false;
+            _not_full.notify_one();
+        }
+
+        _not_empty.wait(lock, [&](){ return _count > 0; });
+        if (_ring[_head].size == 0)
+        {
+            _head = (_head + 1) % _ring.size();
+            --_count;
+            _not_full.notify_one();
+            return nullptr;
+        }
+
+        _holding = true;
+        return &_ring[_head];
+    }
+};
+
+#endif
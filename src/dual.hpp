@@ -0,0 +1,192 @@
+#ifndef DUAL_HPP
+#define DUAL_HPP
+
+#include<iostream>
+#include<cmath>
+#include<array>
+#include<vector>
+#include<algorithm>
+#include<assert.h>
+
+// Forward-mode autodiff. A Dual carries a value and N tangents, the derivatives of that value along N input
+// directions at once. Arithmetic propagates all of them, so one forward pass gives N Jacobian-vector products
+// with no graph and no heap allocation. The tangents are a fixed-size aligned array, updated by loops of
+// compile-time length that the compiler unrolls and vectorises.
+template <class T, size_t N>
+class Dual
+{
+    friend std::ostream& operator<<(std::ostream& os, const Dual<T, N>& val)
+    {
+        os << "Dual(" << val._value << ", [";
+        for (size_t k=0; k<N; ++k)
+            os << val._tangent[k] << (k+1 < N ? ", " : "");
+        os << "])";
+        return os;
+    }
+
+    friend Dual<T, N> pow(const Dual<T, N>& val, const T& exp)
+    {
+        const T d = exp * std::pow(val._value, exp - static_cast<T>(1));
+        Dual<T, N> out(std::pow(val._value, exp));
+        for (size_t k=0; k<N; ++k)
+            out._tangent[k] = d * val._tangent[k];
+        return out;
+    }
+
+    friend Dual<T, N> operator+(const T& num, const Dual<T, N>& val) { return val + num; }
+    friend Dual<T, N> operator-(const T& num, const Dual<T, N>& val) { return Dual<T, N>(num) - val; }
+    friend Dual<T, N> operator*(const T& num, const Dual<T, N>& val) { return val * num; }
+    friend Dual<T, N> operator/(const T& num, const Dual<T, N>& val) { return Dual<T, N>(num) / val; }
+
+private:
+    T _value;
+    alignas(32) std::array<T, N> _tangent;
+
+public:
+    // Constant, with zero tangents
+    Dual(const T& value=static_cast<T>(0)): _value{value} { _tangent.fill(static_cast<T>(0)); }
+    Dual(const T& value, const std::array<T, N>& tangent): _value{value}, _tangent(tangent) {}
+
+    // Input seeded with a unit tangent in lane
+    static Dual<T, N> variable(const T& value, const size_t& lane)
+    {
+        assert(lane < N);
+        Dual<T, N> rval(value);
+        rval._tangent[lane] = static_cast<T>(1);
+        return rval;
+    }
+
+    // Getters
+    static constexpr size_t lanes() { return N; }
+    const T& get_value() const { return _value; }
+    const T& get_tangent(const size_t& lane) const { return _tangent[lane]; }
+    const std::array<T, N>& get_tangents() const { return _tangent; }
+    T& get_value() { return _value; }
+    T& get_tangent(const size_t& lane) { return _tangent[lane]; }
+
+    // this += a * x, the inner step of an affine map with constant weights
+    Dual<T, N>& add_scaled(const T& a, const Dual<T, N>& x)
+    {
+        _value += a * x._value;
+        for (size_t k=0; k<N; ++k)
+            _tangent[k] += a * x._tangent[k];
+        return *this;
+    }
+
+    Dual<T, N> relu() const
+    {
+        return _value > static_cast<T>(0) ? *this : Dual<T, N>(static_cast<T>(0));
+    }
+
+    // Arithmetic operators
+    Dual<T, N>& operator+=(const Dual<T, N>& other)
+    {
+        _value += other._value;
+        for (size_t k=0; k<N; ++k)
+            _tangent[k] += other._tangent[k];
+        return *this;
+    }
+
+    Dual<T, N>& operator-=(const Dual<T, N>& other)
+    {
+        _value -= other._value;
+        for (size_t k=0; k<N; ++k)
+            _tangent[k] -= other._tangent[k];
+        return *this;
+    }
+
+    Dual<T, N>& operator*=(const Dual<T, N>& other)
+    {
+        for (size_t k=0; k<N; ++k)
+            _tangent[k] = _tangent[k] * other._value + _value * other._tangent[k];
+        _value *= other._value;
+        return *this;
+    }
+
+    Dual<T, N>& operator/=(const Dual<T, N>& other)
+    {
+        const T inv = static_cast<T>(1) / other._value;
+        const T q = _value * inv;
+        for (size_t k=0; k<N; ++k)
+            _tangent[k] = (_tangent[k] - q * other._tangent[k]) * inv;
+        _value = q;
+        return *this;
+    }
+
+    Dual<T, N> operator+(const Dual<T, N>& other) const { Dual<T, N> rval = *this; return rval += other; }
+    Dual<T, N> operator-(const Dual<T, N>& other) const { Dual<T, N> rval = *this; return rval -= other; }
+    Dual<T, N> operator*(const Dual<T, N>& other) const { Dual<T, N> rval = *this; return rval *= other; }
+    Dual<T, N> operator/(const Dual<T, N>& other) const { Dual<T, N> rval = *this; return rval /= other; }
+
+    Dual<T, N> operator+(const T& other) const { Dual<T, N> rval = *this; rval._value += other; return rval; }
+    Dual<T, N> operator-(const T& other) const { Dual<T, N> rval = *this; rval._value -= other; return rval; }
+
+    Dual<T, N> operator*(const T& other) const
+    {
+        Dual<T, N> rval(_value * other);
+        for (size_t k=0; k<N; ++k)
+            rval._tangent[k] = _tangent[k] * other;
+        return rval;
+    }
+
+    Dual<T, N> operator/(const T& other) const
+    {
+        return operator*(static_cast<T>(1) / other);
+    }
+
+    Dual<T, N> operator-() const
+    {
+        return operator*(static_cast<T>(-1));
+    }
+
+    // Comparison operators, on the value
+    bool operator==(const Dual<T, N>& other) const { return _value == other._value; }
+    bool operator<(const Dual<T, N>& other) const { return _value < other._value; }
+    bool operator>(const Dual<T, N>& other) const { return _value > other._value; }
+    bool operator<=(const Dual<T, N>& other) const { return _value <= other._value; }
+    bool operator>=(const Dual<T, N>& other) const { return _value >= other._value; }
+};
+
+// Outputs of model at input and the Jacobian-vector products J*directions[k], for up to N directions, in
+// one forward pass. Model is anything with an operator() over std::vector<Dual<T, N>>, such as Layer or MLP
+template <size_t N, class T, class Model>
+std::vector<Dual<T, N>> jvp(const Model& model, const std::vector<T>& input, const std::vector<std::vector<T>>& directions)
+{
+    assert(directions.size() <= N);
+
+    std::vector<Dual<T, N>> duals(input.begin(), input.end());
+    for (size_t k=0; k<directions.size(); ++k)
+    {
+        assert(directions[k].size() == input.size());
+        for (size_t i=0; i<input.size(); ++i)
+            duals[i].get_tangent(k) = directions[k][i];
+    }
+    return model(duals);
+}
+
+// Full Jacobian of model at input, rows by output, in ceil(inputs / N) forward passes of N input lanes each
+template <size_t N, class T, class Model>
+std::vector<std::vector<T>> jacobian(const Model& model, const std::vector<T>& input)
+{
+    std::vector<std::vector<T>> rval;
+    std::vector<Dual<T, N>> duals(input.begin(), input.end());
+    for (size_t begin=0; begin<input.size(); begin+=N)
+    {
+        const size_t end = std::min(begin + N, input.size());
+        for (size_t i=begin; i<end; ++i)
+            duals[i].get_tangent(i - begin) = static_cast<T>(1);
+
+        const auto output = model(duals);
+        if (rval.empty())
+            rval.assign(output.size(), std::vector<T>(input.size()));
+        for (size_t j=0; j<output.size(); ++j)
+            for (size_t i=begin; i<end; ++i)
+                rval[j][i] = output[j].get_tangent(i - begin);
+
+        for (size_t i=begin; i<end; ++i)
+            duals[i].get_tangent(i - begin) = static_cast<T>(0);
+    }
+    return rval;
+}
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef EXPRESSION_HPP
+#define EXPRESSION_HPP
+
+#include<cmath>
+#include<vector>
+#include<memory>
+#include<cstddef>
+
+// Expression templates over Value. lazy(v) wraps a Value so that arithmetic on it builds a typed expression
+// tree instead of graph nodes; converting the result to a Value creates a single node whose parents are the
+// Values in the expression. Its forward value and its backward pass are generated from the expression type at
+// compile time, so e.g. pow(lazy(y) - t, 2) costs one node instead of a leaf for t and a node per op.
+//
+// Expressions refer to the Values they were built from, so like any temporary they should be turned into a
+// Value within the statement that builds them.
+
+// Forward declarations
+template<class T> class _Value;
+template<class T> class Value;
+
+// CRTP base of every expression. E provides
+//   T eval() const                    forward value
+//   void backward(const T& g) const   adds g * d(expression)/d(leaf) to each leaf's grad
+//   void collect(parents) const       appends the leaves' nodes, in order
+//   static constexpr size_t leaves    number of Value leaves
+template <class T, class E>
+class Expr
+{
+public:
+    using value_type = T;
+
+    const E& self() const { return static_cast<const E&>(*this); }
+};
+
+// A Value in an expression. The node pointer is what the fused backward uses; the Value itself is only
+// needed to collect the shared parent pointers when the expression is turned into a node
+template <class T>
+class ExprLeaf: public Expr<T, ExprLeaf<T>>
+{
+private:
+    const Value<T>* _value;
+    _Value<T>* _node;
+
+public:
+    static constexpr size_t leaves = 1;
+
+    ExprLeaf(const Value<T>& value): _value{&value}, _node{value.get_ptr().get()} {}
+
+    T eval() const { return _node->get_data(); }
+    void backward(const T& g) const { _node->get_grad() += g; }
+    void collect(std::vector<std::shared_ptr<_Value<T>>>& parents) const { parents.push_back(_value->get_ptr()); }
+};
+
+// A plain number, which takes no gradient
+template <class T>
+class ExprConst: public Expr<T, ExprConst<T>>
+{
+private:
+    T _value;
+
+public:
+    static constexpr size_t leaves = 0;
+
+    ExprConst(const T& value): _value{value} {}
+
+    T eval() const { return _value; }
+    void backward(const T&) const {}
+    void collect(std::vector<std::shared_ptr<_Value<T>>>&) const {}
+};
+
+template <class T>
+ExprLeaf<T> lazy(const Value<T>& value) { return ExprLeaf<T>(value); }
+
+// Binary node. Op provides the forward value and the partial derivatives with respect to each operand
+template <class T, class L, class R, class Op>
+class ExprBinary: public Expr<T, ExprBinary<T, L, R, Op>>
+{
+private:
+    L _lhs;
+    R _rhs;
+
+public:
+    static constexpr size_t leaves = L::leaves + R::leaves;
+
+    ExprBinary(const L& lhs, const R& rhs): _lhs{lhs}, _rhs{rhs} {}
+
+    T eval() const { return Op::eval(_lhs.eval(), _rhs.eval()); }
+    void backward(const T& g) const
+    {
+        const T a = _lhs.eval();
+        const T b = _rhs.eval();
+        _lhs.backward(Op::d_lhs(a, b) * g);
+        _rhs.backward(Op::d_rhs(a, b) * g);
+    }
+    void collect(std::vector<std::shared_ptr<_Value<T>>>& parents) const
+    {
+        _lhs.collect(parents);
+        _rhs.collect(parents);
+    }
+};
+
+// Unary node, with Op's parameter (such as the exponent of pow) held alongside its operand
+template <class T, class A, class Op>
+class ExprUnary: public Expr<T, ExprUnary<T, A, Op>>
+{
+private:
+    A _arg;
+    T _param;
+
+public:
+    static constexpr size_t leaves = A::leaves;
+
+    ExprUnary(const A& arg, const T& param): _arg{arg}, _param{param} {}
+
+    T eval() const { return Op::eval(_arg.eval(), _param); }
+    void backward(const T& g) const { _arg.backward(Op::d_arg(_arg.eval(), _param) * g); }
+    void collect(std::vector<std::shared_ptr<_Value<T>>>& parents) const { _arg.collect(parents); }
+};
+
+// Ops
+struct ExprAdd
+{
+    template <class T> static T eval(const T& a, const T& b) { return a + b; }
+    template <class T> static T d_lhs(const T&, const T&) { return static_cast<T>(1); }
+    template <class T> static T d_rhs(const T&, const T&) { return static_cast<T>(1); }
+};
+
+struct ExprSub
+{
+    template <class T> static T eval(const T& a, const T& b) { return a - b; }
+    template <class T> static T d_lhs(const T&, const T&) { return static_cast<T>(1); }
+    template <class T> static T d_rhs(const T&, const T&) { return static_cast<T>(-1); }
+};
+
+struct ExprMul
+{
+    template <class T> static T eval(const T& a, const T& b) { return a * b; }
+    template <class T> static T d_lhs(const T&, const T& b) { return b; }
+    template <class T> static T d_rhs(const T& a, const T&) { return a; }
+};
+
+struct ExprDiv
+{
+    template <class T> static T eval(const T& a, const T& b) { return a / b; }
+    template <class T> static T d_lhs(const T&, const T& b) { return static_cast<T>(1) / b; }
+    template <class T> static T d_rhs(const T& a, const T& b) { return -a / (b * b); }
+};
+
+struct ExprPow
+{
+    template <class T> static T eval(const T& x, const T& exp) { return std::pow(x, exp); }
+    template <class T> static T d_arg(const T& x, const T& exp) { return exp * std::pow(x, exp - static_cast<T>(1)); }
+};
+
+struct ExprRelu
+{
+    template <class T> static T eval(const T& x, const T&) { return x > static_cast<T>(0) ? x : static_cast<T>(0); }
+    template <class T> static T d_arg(const T& x, const T&) { return x > static_cast<T>(0) ? static_cast<T>(1) : static_cast<T>(0); }
+};
+
+// Operators between expressions, Values and plain numbers. At least one side is an expression, so plain
+// Value arithmetic is unchanged. The number's type is taken from the expression rather than deduced
+#define CPP_GRAD_EXPR_BINARY(op, Op) \
+template <class T, class L, class R> \
+ExprBinary<T, L, R, Op> operator op(const Expr<T, L>& lhs, const Expr<T, R>& rhs) \
+{ return ExprBinary<T, L, R, Op>(lhs.self(), rhs.self()); } \
+template <class T, class L> \
+ExprBinary<T, L, ExprLeaf<T>, Op> operator op(const Expr<T, L>& lhs, const Value<T>& rhs) \
+{ return ExprBinary<T, L, ExprLeaf<T>, Op>(lhs.self(), ExprLeaf<T>(rhs)); } \
+template <class T, class R> \
+ExprBinary<T, ExprLeaf<T>, R, Op> operator op(const Value<T>& lhs, const Expr<T, R>& rhs) \
+{ return ExprBinary<T, ExprLeaf<T>, R, Op>(ExprLeaf<T>(lhs), rhs.self()); } \
+template <class T, class L> \
+ExprBinary<T, L, ExprConst<T>, Op> operator op(const Expr<T, L>& lhs, const typename Expr<T, L>::value_type& rhs) \
+{ return ExprBinary<T, L, ExprConst<T>, Op>(lhs.self(), ExprConst<T>(rhs)); } \
+template <class T, class R> \
+ExprBinary<T, ExprConst<T>, R, Op> operator op(const typename Expr<T, R>::value_type& lhs, const Expr<T, R>& rhs) \
+{ return ExprBinary<T, ExprConst<T>, R, Op>(ExprConst<T>(lhs), rhs.self()); }
+
+CPP_GRAD_EXPR_BINARY(+, ExprAdd)
+CPP_GRAD_EXPR_BINARY(-, ExprSub)
+CPP_GRAD_EXPR_BINARY(*, ExprMul)
+CPP_GRAD_EXPR_BINARY(/, ExprDiv)
+
+#undef CPP_GRAD_EXPR_BINARY
+
+template <class T, class A>
+ExprBinary<T, ExprConst<T>, A, ExprMul> operator-(const Expr<T, A>& arg)
+{
+    return ExprBinary<T, ExprConst<T>, A, ExprMul>(ExprConst<T>(static_cast<T>(-1)), arg.self());
+}
+
+template <class T, class A>
+ExprUnary<T, A, ExprPow> pow(const Expr<T, A>& arg, const typename Expr<T, A>::value_type& exp)
+{
+    return ExprUnary<T, A, ExprPow>(arg.self(), exp);
+}
+
+template <class T, class A>
+ExprUnary<T, A, ExprRelu> relu(const Expr<T, A>& arg)
+{
+    return ExprUnary<T, A, ExprRelu>(arg.self(), static_cast<T>(0));
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef GRAPH_PASSES_HPP
+#define GRAPH_PASSES_HPP
+
+#include<iostream>
+#include<vector>
+#include<map>
+#include<unordered_map>
+#include<algorithm>
+#include<memory>
+#include<utility>
+
+#include "value.hpp"
+
+// Node counts of a graph before and after optimize_graph(). Active nodes are those with parents, whose
+// backward closures run
+struct GraphStats
+{
+    size_t nodes_before = 0;
+    size_t nodes_after = 0;
+    size_t active_before = 0;
+    size_t active_after = 0;
+    size_t folded = 0;
+    size_t merged = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const GraphStats& stats)
+{
+    os << "Nodes " << stats.nodes_before << " -> " << stats.nodes_after << ", with backward "
+       << stats.active_before << " -> " << stats.active_after << " (" << stats.folded << " folded, "
+       << stats.merged << " merged)";
+    return os;
+}
+
+// One pass over the build_topo() order of root, parents first:
+//  - A node requires grad if it is a leaf that does (see Value::constant) or has a parent that does.
+//    Segment nodes always do, since they reach parameters that are not their parents.
+//  - Constant folding and dead-node pruning: a node that does not require grad has no gradient that
+//    reaches a leaf anyone reads. Values are computed eagerly, so it becomes a constant leaf, its backward
+//    is skipped and the part of the graph only it kept alive is freed.
+//  - Common subexpressions: two nodes of the same op over the same parents, for ops whose result depends
+//    on nothing else, are the same function of the leaves. The later one becomes a pass-through of the
+//    first, so the duplicate subgraph below it is no longer walked or kept alive.
+// Nodes are rewritten in place, so run it on a graph before calling backward, and not on one sharing
+// nodes with another graph whose order is already cached.
+template <class T>
+GraphStats optimize_graph(const Value<T>& root)
+{
+    GraphStats stats;
+
+    // Shared owners of every node but the root, to rewire parents. They also keep every node alive until the
+    // pass is done
+    const std::vector<_Value<T>*> order = root.build_topo();
+    std::unordered_map<_Value<T>*, std::shared_ptr<_Value<T>>> owners;
+    stats.nodes_before = order.size();
+    for (auto n : order)
+    {
+        if (!n->get_parent_ptrs().empty())
+            ++stats.active_before;
+        for (auto& p : n->get_parent_ptrs())
+            owners.emplace(p.get(), p);
+    }
+
+    // Nodes are keyed by the first of their duplicates, so consumers of merged nodes still match
+    std::unordered_map<_Value<T>*, bool> needs_grad;
+    std::unordered_map<_Value<T>*, _Value<T>*> first;
+    std::map<std::pair<NodeOp, std::vector<_Value<T>*>>, _Value<T>*> seen;
+    for (auto n : order)
+    {
+        const auto& parents = n->get_parent_ptrs();
+        if (parents.empty())
+        {
+            needs_grad[n] = n->requires_grad();
+            continue;
+        }
+
+        bool any = n->get_op() == NodeOp::segment;
+        for (auto& p : parents)
+            any = any || needs_grad[p.get()];
+        needs_grad[n] = any;
+
+        if (!any)
+        {
+            n->fold();
+            ++stats.folded;
+            continue;
+        }
+
+        const NodeOp op = n->get_op();
+        if (op != NodeOp::add && op != NodeOp::sub && op != NodeOp::mul && op != NodeOp::relu && op != NodeOp::affine)
+            continue;
+
+        std::pair<NodeOp, std::vector<_Value<T>*>> key{op, {}};
+        key.second.reserve(parents.size());
+        for (auto& p : parents)
+        {
+            auto f = first.find(p.get());
+            key.second.push_back(f == first.end() ? p.get() : f->second);
+        }
+        if (op == NodeOp::add || op == NodeOp::mul)
+            std::sort(key.second.begin(), key.second.end());
+
+        auto found = seen.find(key);
+        if (found == seen.end())
+            seen.emplace(std::move(key), n);
+        else
+        {
+            first[n] = found->second;
+            n->merge_into(owners.at(found->second));
+            ++stats.merged;
+        }
+    }
+
+    for (auto n : order)
+        n->clear_topo();
+
+    for (auto n : root.build_topo())
+    {
+        ++stats.nodes_after;
+        if (!n->get_parent_ptrs().empty())
+            ++stats.active_after;
+    }
+    return stats;
+}
+
+#endif
@@ -0,0 +1,406 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include<cstddef>
+#include<cstdint>
+#include<cstring>
+#include<algorithm>
+
+// Vectorised kernels over contiguous arrays. float and double use AVX2/FMA when the CPU supports it,
+// chosen at runtime, and fall back to plain loops otherwise. Any other T always takes the scalar path.
+// The reduced-precision dot products below are dispatched the same way.
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPP_GRAD_X86_SIMD 1
+#include<immintrin.h>
+#endif
+
+inline bool cpu_has_avx2_fma()
+{
+#ifdef CPP_GRAD_X86_SIMD
+    static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has;
+#else
+    return false;
+#endif
+}
+
+// Scalar reference kernels
+template <class T>
+T scalar_dot(const T* x, const T* y, const size_t& n)
+{
+    T rval = static_cast<T>(0);
+    for (size_t i=0; i<n; ++i)
+        rval += x[i] * y[i];
+    return rval;
+}
+
+// y += a*x
+template <class T>
+void scalar_axpy(const T& a, const T* x, T* y, const size_t& n)
+{
+    for (size_t i=0; i<n; ++i)
+        y[i] += a * x[i];
+}
+
+// y = max(0, x)
+template <class T>
+void scalar_relu(const T* x, T* y, const size_t& n)
+{
+    for (size_t i=0; i<n; ++i)
+        y[i] = std::max(static_cast<T>(0), x[i]);
+}
+
+// dx += dy where x > 0
+template <class T>
+void scalar_relu_backward(const T* x, const T* dy, T* dx, const size_t& n)
+{
+    for (size_t i=0; i<n; ++i)
+        if (x[i] > static_cast<T>(0))
+            dx[i] += dy[i];
+}
+
+// bfloat16 is the upper half of an IEEE float
+inline float bf16_to_float(const uint16_t& x)
+{
+    const uint32_t bits = static_cast<uint32_t>(x) << 16;
+    float rval;
+    std::memcpy(&rval, &bits, sizeof(float));
+    return rval;
+}
+
+// Rounds to nearest, ties to even. NaNs stay NaNs
+inline uint16_t float_to_bf16(const float& x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(float));
+    if ((bits & 0x7fffffffu) > 0x7f800000u)
+        return static_cast<uint16_t>((bits >> 16) | 0x40u);
+    bits += 0x7fffu + ((bits >> 16) & 1u);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+// Float inputs against bfloat16 weights, accumulated in float
+inline float scalar_dot_bf16(const float* x, const uint16_t* w, const size_t& n)
+{
+    float rval = 0.0f;
+    for (size_t i=0; i<n; ++i)
+        rval += x[i] * bf16_to_float(w[i]);
+    return rval;
+}
+
+// y += a*w for bfloat16 w, in float
+inline void scalar_axpy_bf16(const float& a, const uint16_t* w, float* y, const size_t& n)
+{
+    for (size_t i=0; i<n; ++i)
+        y[i] += a * bf16_to_float(w[i]);
+}
+
+// int8 by int8, accumulated exactly in int32. n must be below 2^31 / 127^2
+inline int32_t scalar_dot_i8(const int8_t* x, const int8_t* w, const size_t& n)
+{
+    int32_t rval = 0;
+    for (size_t i=0; i<n; ++i)
+        rval += static_cast<int32_t>(x[i]) * static_cast<int32_t>(w[i]);
+    return rval;
+}
+
+#ifdef CPP_GRAD_X86_SIMD
+
+#define CPP_GRAD_AVX2 __attribute__((target("avx2,fma")))
+
+CPP_GRAD_AVX2 inline double avx2_dot(const double* x, const double* y, const size_t& n)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i+8<=n; i+=8)
+    {
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4), acc1);
+    }
+    for (; i+4<=n; i+=4)
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i), acc0);
+
+    acc0 = _mm256_add_pd(acc0, acc1);
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+    double rval = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for (; i<n; ++i)
+        rval += x[i] * y[i];
+    return rval;
+}
+
+CPP_GRAD_AVX2 inline float avx2_dot(const float* x, const float* y, const size_t& n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+16<=n; i+=16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+8), _mm256_loadu_ps(y+i+8), acc1);
+    }
+    for (; i+8<=n; i+=8)
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i), acc0);
+
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 quad = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    quad = _mm_add_ps(quad, _mm_movehl_ps(quad, quad));
+    quad = _mm_add_ss(quad, _mm_shuffle_ps(quad, quad, 1));
+    float rval = _mm_cvtss_f32(quad);
+    for (; i<n; ++i)
+        rval += x[i] * y[i];
+    return rval;
+}
+
+CPP_GRAD_AVX2 inline void avx2_axpy(const double& a, const double* x, double* y, const size_t& n)
+{
+    const __m256d va = _mm256_set1_pd(a);
+    size_t i = 0;
+    for (; i+4<=n; i+=4)
+        _mm256_storeu_pd(y+i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+    for (; i<n; ++i)
+        y[i] += a * x[i];
+}
+
+CPP_GRAD_AVX2 inline void avx2_axpy(const float& a, const float* x, float* y, const size_t& n)
+{
+    const __m256 va = _mm256_set1_ps(a);
+    size_t i = 0;
+    for (; i+8<=n; i+=8)
+        _mm256_storeu_ps(y+i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x+i), _mm256_loadu_ps(y+i)));
+    for (; i<n; ++i)
+        y[i] += a * x[i];
+}
+
+CPP_GRAD_AVX2 inline void avx2_relu(const double* x, double* y, const size_t& n)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i+4<=n; i+=4)
+        _mm256_storeu_pd(y+i, _mm256_max_pd(_mm256_loadu_pd(x+i), zero));
+    for (; i<n; ++i)
+        y[i] = std::max(0.0, x[i]);
+}
+
+CPP_GRAD_AVX2 inline void avx2_relu(const float* x, float* y, const size_t& n)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+8<=n; i+=8)
+        _mm256_storeu_ps(y+i, _mm256_max_ps(_mm256_loadu_ps(x+i), zero));
+    for (; i<n; ++i)
+        y[i] = std::max(0.0f, x[i]);
+}
+
+CPP_GRAD_AVX2 inline void avx2_relu_backward(const double* x, const double* dy, double* dx, const size_t& n)
+{
+    const __m256d zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i+4<=n; i+=4)
+    {
+        __m256d mask = _mm256_cmp_pd(_mm256_loadu_pd(x+i), zero, _CMP_GT_OQ);
+        __m256d g = _mm256_and_pd(mask, _mm256_loadu_pd(dy+i));
+        _mm256_storeu_pd(dx+i, _mm256_add_pd(_mm256_loadu_pd(dx+i), g));
+    }
+    for (; i<n; ++i)
+        if (x[i] > 0.0)
+            dx[i] += dy[i];
+}
+
+CPP_GRAD_AVX2 inline void avx2_relu_backward(const float* x, const float* dy, float* dx, const size_t& n)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+8<=n; i+=8)
+    {
+        __m256 mask = _mm256_cmp_ps(_mm256_loadu_ps(x+i), zero, _CMP_GT_OQ);
+        __m256 g = _mm256_and_ps(mask, _mm256_loadu_ps(dy+i));
+        _mm256_storeu_ps(dx+i, _mm256_add_ps(_mm256_loadu_ps(dx+i), g));
+    }
+    for (; i<n; ++i)
+        if (x[i] > 0.0f)
+            dx[i] += dy[i];
+}
+
+CPP_GRAD_AVX2 inline float avx2_dot_bf16(const float* x, const uint16_t* w, const size_t& n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+16<=n; i+=16)
+    {
+        __m256i w0 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w+i)));
+        __m256i w1 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w+i+8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_castsi256_ps(_mm256_slli_epi32(w0, 16)), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i+8), _mm256_castsi256_ps(_mm256_slli_epi32(w1, 16)), acc1);
+    }
+    for (; i+8<=n; i+=8)
+    {
+        __m256i w0 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w+i)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x+i), _mm256_castsi256_ps(_mm256_slli_epi32(w0, 16)), acc0);
+    }
+
+    acc0 = _mm256_add_ps(acc0, acc1);
+    __m128 quad = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    quad = _mm_add_ps(quad, _mm_movehl_ps(quad, quad));
+    quad = _mm_add_ss(quad, _mm_shuffle_ps(quad, quad, 1));
+    float rval = _mm_cvtss_f32(quad);
+    for (; i<n; ++i)
+        rval += x[i] * bf16_to_float(w[i]);
+    return rval;
+}
+
+CPP_GRAD_AVX2 inline void avx2_axpy_bf16(const float& a, const uint16_t* w, float* y, const size_t& n)
+{
+    const __m256 va = _mm256_set1_ps(a);
+    size_t i = 0;
+    for (; i+8<=n; i+=8)
+    {
+        __m256i w0 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w+i)));
+        __m256 wf = _mm256_castsi256_ps(_mm256_slli_epi32(w0, 16));
+        _mm256_storeu_ps(y+i, _mm256_fmadd_ps(va, wf, _mm256_loadu_ps(y+i)));
+    }
+    for (; i<n; ++i)
+        y[i] += a * bf16_to_float(w[i]);
+}
+
+CPP_GRAD_AVX2 inline int32_t avx2_dot_i8(const int8_t* x, const int8_t* w, const size_t& n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i+16<=n; i+=16)
+    {
+        // Widen to int16 and multiply-add adjacent pairs into int32
+        __m256i a = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x+i)));
+        __m256i b = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w+i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+    }
+
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    int32_t rval = _mm_cvtsi128_si32(half);
+    for (; i<n; ++i)
+        rval += static_cast<int32_t>(x[i]) * static_cast<int32_t>(w[i]);
+    return rval;
+}
+
+#undef CPP_GRAD_AVX2
+
+#endif
+
+// Dispatching entry points
+template <class T>
+T simd_dot(const T* x, const T* y, const size_t& n) { return scalar_dot(x, y, n); }
+
+template <class T>
+void simd_axpy(const T& a, const T* x, T* y, const size_t& n) { scalar_axpy(a, x, y, n); }
+
+template <class T>
+void simd_relu(const T* x, T* y, const size_t& n) { scalar_relu(x, y, n); }
+
+template <class T>
+void simd_relu_backward(const T* x, const T* dy, T* dx, const size_t& n) { scalar_relu_backward(x, dy, dx, n); }
+
+#ifdef CPP_GRAD_X86_SIMD
+
+template <>
+inline double simd_dot<double>(const double* x, const double* y, const size_t& n)
+{
+    return cpu_has_avx2_fma() ? avx2_dot(x, y, n) : scalar_dot(x, y, n);
+}
+
+template <>
+inline void simd_axpy<double>(const double& a, const double* x, double* y, const size_t& n)
+{
+    if (cpu_has_avx2_fma())
+        avx2_axpy(a, x, y, n);
+    else
+        scalar_axpy(a, x, y, n);
+}
+
+template <>
+inline void simd_relu<double>(const double* x, double* y, const size_t& n)
+{
+    if (cpu_has_avx2_fma())
+        avx2_relu(x, y, n);
+    else
+        scalar_relu(x, y, n);
+}
+
+template <>
+inline void simd_relu_backward<double>(const double* x, const double* dy, double* dx, const size_t& n)
+{
+    if (cpu_has_avx2_fma())
+        avx2_relu_backward(x, dy, dx, n);
+    else
+        scalar_relu_backward(x, dy, dx, n);
+}
+
+template <>
+inline float simd_dot<float>(const float* x, const float* y, const size_t& n)
+{
+    return cpu_has_avx2_fma() ? avx2_dot(x, y, n) : scalar_dot(x, y, n);
+}
+
+template <>
+inline void simd_axpy<float>(const float& a, const float* x, float* y, const size_t& n)
+{
+    if (cpu_has_avx2_fma())
+        avx2_axpy(a, x, y, n);
+    else
+        scalar_axpy(a, x, y, n);
+}
+
+template <>
+inline void simd_relu<float>(const float* x, float* y, const size_t& n)
+{
+    if (cpu_has_avx2_fma())
+        avx2_relu(x, y, n);
+    else
+        scalar_relu(x, y, n);
+}
+
+template <>
+inline void simd_relu_backward<float>(const float* x, const float* dy, float* dx, const size_t& n)
+{
+    if (cpu_has_avx2_fma())
+        avx2_relu_backward(x, dy, dx, n);
+    else
+        scalar_relu_backward(x, dy, dx, n);
+}
+
+#endif
+
+inline float simd_dot_bf16(const float* x, const uint16_t* w, const size_t& n)
+{
+#ifdef CPP_GRAD_X86_SIMD
+    if (cpu_has_avx2_fma())
+        return avx2_dot_bf16(x, w, n);
+#endif
+    return scalar_dot_bf16(x, w, n);
+}
+
+inline void simd_axpy_bf16(const float& a, const uint16_t* w, float* y, const size_t& n)
+{
+#ifdef CPP_GRAD_X86_SIMD
+    if (cpu_has_avx2_fma())
+    {
+        avx2_axpy_bf16(a, w, y, n);
+        return;
+    }
+#endif
+    scalar_axpy_bf16(a, w, y, n);
+}
+
+inline int32_t simd_dot_i8(const int8_t* x, const int8_t* w, const size_t& n)
+{
+#ifdef CPP_GRAD_X86_SIMD
+    if (cpu_has_avx2_fma())
+        return avx2_dot_i8(x, w, n);
+#endif
+    return scalar_dot_i8(x, w, n);
+}
+
+#endif
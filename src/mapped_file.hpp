@@ -0,0 +1,86 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include<string>
+#include<stdexcept>
+#include<utility>
+
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+// Memory mapping of a whole file. Mappings are private: a writable one is copy-on-write, so writes through
+// it are never carried back to the file
+class MappedFile
+{
+private:
+    unsigned char* _data = nullptr;
+    size_t _size = 0;
+
+public:
+    MappedFile() = default;
+    MappedFile(const std::string& filename, const bool& writable=false)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Error opening file: " + filename + ".");
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("Error reading file size: " + filename + ".");
+        }
+
+        _size = static_cast<size_t>(st.st_size);
+        if (_size > 0)
+        {
+            void* ptr = ::mmap(nullptr, _size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("Error mapping file: " + filename + ".");
+            }
+            _data = static_cast<unsigned char*>(ptr);
+        }
+        ::close(fd);
+    }
+    ~MappedFile() { unmap(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) { std::swap(_data, other._data); std::swap(_size, other._size); }
+    MappedFile& operator=(MappedFile&& other)
+    {
+        if (&other != this)
+        {
+            unmap();
+            std::swap(_data, other._data);
+            std::swap(_size, other._size);
+        }
+        return *this;
+    }
+
+    void unmap()
+    {
+        if (_data)
+            ::munmap(_data, _size);
+        _data = nullptr;
+        _size = 0;
+    }
+
+    const unsigned char* data() const { return _data; }
+    // Only to be written through for writable mappings
+    unsigned char* data() { return _data; }
+    size_t size() const { return _size; }
+    bool is_open() const { return _data != nullptr; }
+};
+
+inline bool file_exists(const std::string& filename)
+{
+    struct stat st;
+    return ::stat(filename.c_str(), &st) == 0;
+}
+
+#endif
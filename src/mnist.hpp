@@ -0,0 +1,337 @@
+#ifndef MNIST_HPP
+#define MNIST_HPP
+
+#include<iostream>
+#include<fstream>
+#include<string>
+#include<vector>
+#include<cstdint>
+#include<cstring>
+#include<cstdio>
+#include<stdexcept>
+#include<utility>
+#include<algorithm>
+#include<assert.h>
+
+#include "mapped_file.hpp"
+
+// Header of an IDX file: two zero bytes, an element type code, the number of dimensions and then one
+// big-endian uint32 per dimension
+struct IdxHeader
+{
+    unsigned char type;
+    std::vector<size_t> dims;
+    size_t offset;
+};
+
+inline IdxHeader parse_idx_header(const MappedFile& file, const std::string& filename)
+{
+    const unsigned char* p = file.data();
+    if (file.size() < 4 || p[0] != 0 || p[1] != 0)
+        throw std::runtime_error("Not an IDX file: " + filename + ".");
+
+    IdxHeader header{p[2], {}, 4 + 4 * static_cast<size_t>(p[3])};
+    if (file.size() < header.offset)
+        throw std::runtime_error("Truncated IDX header: " + filename + ".");
+
+    size_t count = 1;
+    for (size_t i=0; i<p[3]; ++i)
+    {
+        const unsigned char* d = p + 4 + 4*i;
+        header.dims.push_back((size_t(d[0]) << 24) | (size_t(d[1]) << 16) | (size_t(d[2]) << 8) | size_t(d[3]));
+        count *= header.dims.back();
+    }
+
+    // Only unsigned byte data, which is all MNIST uses
+    if (header.type != 0x08 || file.size() < header.offset + count)
+        throw std::runtime_error("Unsupported or truncated IDX data: " + filename + ".");
+    return header;
+}
+
+// Checked once on load, so label() and the loaders built on it can index by label unchecked
+inline void check_idx_labels(const unsigned char* labels, const size_t& rows, const size_t& num_labels, const std::string& filename)
+{
+    for (size_t i=0; i<rows; ++i)
+        if (labels[i] >= num_labels)
+            throw std::runtime_error("Label out of range in " + filename + ".");
+}
+
+// Interface for row-addressable labelled datasets, as consumed by DataLoader
+template <class T>
+class Dataset
+{
+public:
+    Dataset() = default;
+    Dataset(const Dataset&) = default;
+    Dataset(Dataset&&) = default;
+    Dataset& operator=(const Dataset&) = default;
+    Dataset& operator=(Dataset&&) = default;
+    virtual ~Dataset() = default;
+
+    virtual size_t size() const = 0;
+    virtual size_t cols() const = 0;
+    virtual size_t label(const size_t& i) const = 0;
+
+    // Writes the cols() values of row i to dst
+    virtual void copy_row(const size_t& i, T* dst) const = 0;
+};
+
+// Image-classification dataset held as one contiguous row-major block of normalised pixels plus one
+// class index per row. Built either from the native IDX files, normalising in a single pass, or from a
+// preprocessed cache which is memory-mapped and used in place.
+template <class T>
+class MnistDataset: public Dataset<T>
+{
+private:
+    // Cache layout: this header, rows*cols values of T, then rows label bytes
+    struct CacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t value_size;
+        uint32_t reserved;
+        uint64_t rows;
+        uint64_t cols;
+    };
+    static constexpr uint32_t cache_version = 1;
+    static constexpr size_t num_labels = 10;
+
+    MappedFile _file;
+    std::vector<T> _owned_images;
+    std::vector<unsigned char> _owned_labels;
+    const T* _images = nullptr;
+    const unsigned char* _labels = nullptr;
+    size_t _rows = 0;
+    size_t _cols = 0;
+
+    void check_labels(const std::string& filename) const { check_idx_labels(_labels, _rows, num_labels, filename); }
+
+public:
+    MnistDataset() = default;
+    MnistDataset(const MnistDataset&) = delete;
+    MnistDataset& operator=(const MnistDataset&) = delete;
+    MnistDataset(MnistDataset&&) = default;
+    MnistDataset& operator=(MnistDataset&&) = default;
+
+    // Pixels are mapped to value/255 - 0.5, as in get_mnist_data
+    static MnistDataset from_idx(const std::string& images_filename, const std::string& labels_filename)
+    {
+        MappedFile images(images_filename);
+        MappedFile labels(labels_filename);
+        IdxHeader ih = parse_idx_header(images, images_filename);
+        IdxHeader lh = parse_idx_header(labels, labels_filename);
+        if (ih.dims.empty() || lh.dims.size() != 1 || lh.dims[0] != ih.dims[0])
+            throw std::runtime_error("Mismatched IDX images and labels: " + images_filename + ".");
+
+        MnistDataset rval;
+        rval._rows = ih.dims[0];
+        rval._cols = 1;
+        for (size_t i=1; i<ih.dims.size(); ++i)
+            rval._cols *= ih.dims[i];
+
+        const unsigned char* src = images.data() + ih.offset;
+        rval._owned_images.resize(rval._rows * rval._cols);
+        T* dst = rval._owned_images.data();
+        for (size_t i=0; i<rval._owned_images.size(); ++i)
+            dst[i] = static_cast<T>(src[i]) / static_cast<T>(255) - static_cast<T>(0.5);
+
+        rval._owned_labels.assign(labels.data() + lh.offset, labels.data() + lh.offset + rval._rows);
+        rval._images = rval._owned_images.data();
+        rval._labels = rval._owned_labels.data();
+        rval.check_labels(labels_filename);
+        return rval;
+    }
+
+    // Packs already normalised rows and one-hot labels, as returned by get_mnist_data
+    static MnistDataset from_rows(const std::vector<std::vector<T>>& images, const std::vector<std::vector<T>>& labels)
+    {
+        if (images.size() != labels.size())
+            throw std::runtime_error("Mismatched image and label rows.");
+
+        MnistDataset rval;
+        rval._rows = images.size();
+        rval._cols = images.empty() ? 0 : images.front().size();
+        rval._owned_images.reserve(rval._rows * rval._cols);
+        rval._owned_labels.reserve(rval._rows);
+        for (size_t i=0; i<rval._rows; ++i)
+        {
+            if (images[i].size() != rval._cols)
+                throw std::runtime_error("Ragged image rows.");
+            rval._owned_images.insert(rval._owned_images.end(), images[i].begin(), images[i].end());
+            rval._owned_labels.push_back(static_cast<unsigned char>(std::max_element(labels[i].begin(), labels[i].end()) - labels[i].begin()));
+        }
+
+        rval._images = rval._owned_images.data();
+        rval._labels = rval._owned_labels.data();
+        rval.check_labels("label rows");
+        return rval;
+    }
+
+    static MnistDataset from_cache(const std::string& filename)
+    {
+        MnistDataset rval;
+        rval._file = MappedFile(filename);
+
+        const unsigned char* p = rval._file.data();
+        CacheHeader header;
+        if (rval._file.size() < sizeof(CacheHeader))
+            throw std::runtime_error("Truncated dataset cache: " + filename + ".");
+        std::memcpy(&header, p, sizeof(CacheHeader));
+        if (std::memcmp(header.magic, "CGDS", 4) != 0 || header.version != cache_version || header.value_size != sizeof(T))
+            throw std::runtime_error("Incompatible dataset cache: " + filename + ".");
+
+        rval._rows = header.rows;
+        rval._cols = header.cols;
+        if (rval._file.size() < sizeof(CacheHeader) + rval._rows * rval._cols * sizeof(T) + rval._rows)
+            throw std::runtime_error("Truncated dataset cache: " + filename + ".");
+
+        // The mapping is page aligned and the header is 32 bytes, so the values are suitably aligned
+        rval._images = reinterpret_cast<const T*>(p + sizeof(CacheHeader));
+        rval._labels = p + sizeof(CacheHeader) + rval._rows * rval._cols * sizeof(T);
+        rval.check_labels(filename);
+        return rval;
+    }
+
+    // Prefers the cache, otherwise reads the IDX files and writes the cache for next time. A cache that
+    // fails to load, such as one from another version, is rebuilt the same way. A cache that cannot be
+    // written is skipped with a warning
+    static MnistDataset load(const std::string& images_filename, const std::string& labels_filename, const std::string& cache_filename)
+    {
+        if (file_exists(cache_filename))
+        {
+            try
+            {
+                return from_cache(cache_filename);
+            }
+            catch (const std::runtime_error& e)
+            {
+                std::cerr << e.what() << " Rebuilding it." << std::endl;
+            }
+        }
+
+        // The cache only saves time next run, so failing to write it, say to a read-only directory, is not fatal
+        MnistDataset rval = from_idx(images_filename, labels_filename);
+        try
+        {
+            rval.save_cache(cache_filename);
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << e.what() << " Continuing without a cache." << std::endl;
+        }
+        return rval;
+    }
+
+    // Written to a temporary file and renamed into place, so an interrupted write never leaves a
+    // truncated cache behind
+    void save_cache(const std::string& filename) const
+    {
+        const std::string tmp_filename = filename + ".tmp";
+        std::ofstream file(tmp_filename, std::ios::binary);
+        if (!file.is_open())
+            throw std::runtime_error("Error opening file: " + tmp_filename + ".");
+
+        CacheHeader header{{'C', 'G', 'D', 'S'}, cache_version, sizeof(T), 0, _rows, _cols};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(CacheHeader));
+        file.write(reinterpret_cast<const char*>(_images), _rows * _cols * sizeof(T));
+        file.write(reinterpret_cast<const char*>(_labels), _rows);
+        file.close();
+        if (!file.good())
+        {
+            std::remove(tmp_filename.c_str());
+            throw std::runtime_error("Error writing file: " + tmp_filename + ".");
+        }
+
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+        {
+            std::remove(tmp_filename.c_str());
+            throw std::runtime_error("Error renaming " + tmp_filename + " to " + filename + ".");
+        }
+    }
+
+    // Getters
+    size_t size() const { return _rows; }
+    size_t cols() const { return _cols; }
+    const T* data() const { return _images; }
+    const T* row(const size_t& i) const { assert(i < _rows); return _images + i * _cols; }
+    const unsigned char* labels() const { return _labels; }
+    size_t label(const size_t& i) const { assert(i < _rows); return _labels[i]; }
+    void copy_row(const size_t& i, T* dst) const { std::memcpy(dst, row(i), _cols * sizeof(T)); }
+
+    // One-hot label, built on request
+    std::vector<T> label_vector(const size_t& i, const size_t& num_classes=num_labels) const
+    {
+        assert(label(i) < num_classes);
+        std::vector<T> rval(num_classes, static_cast<T>(0));
+        rval[label(i)] = static_cast<T>(1);
+        return rval;
+    }
+
+    // Copies into the nested layout used by get_mnist_data
+    std::vector<std::vector<T>> image_rows() const
+    {
+        std::vector<std::vector<T>> rval;
+        rval.reserve(_rows);
+        for (size_t i=0; i<_rows; ++i)
+            rval.emplace_back(row(i), row(i) + _cols);
+        return rval;
+    }
+
+    std::vector<std::vector<T>> label_rows(const size_t& num_classes=num_labels) const
+    {
+        std::vector<std::vector<T>> rval;
+        rval.reserve(_rows);
+        for (size_t i=0; i<_rows; ++i)
+            rval.push_back(label_vector(i, num_classes));
+        return rval;
+    }
+};
+
+// IDX images and labels left on disk as mapped raw bytes. Rows are normalised only when read, so the
+// dataset can be larger than memory and the work is done by whichever thread reads the rows
+template <class T>
+class IdxStream: public Dataset<T>
+{
+private:
+    static constexpr size_t num_labels = 10;
+
+    MappedFile _images_file;
+    MappedFile _labels_file;
+    const unsigned char* _images = nullptr;
+    const unsigned char* _labels = nullptr;
+    size_t _rows = 0;
+    size_t _cols = 0;
+
+public:
+    IdxStream(const std::string& images_filename, const std::string& labels_filename):
+    _images_file{images_filename}, _labels_file{labels_filename}
+    {
+        IdxHeader ih = parse_idx_header(_images_file, images_filename);
+        IdxHeader lh = parse_idx_header(_labels_file, labels_filename);
+        if (ih.dims.empty() || lh.dims.size() != 1 || lh.dims[0] != ih.dims[0])
+            throw std::runtime_error("Mismatched IDX images and labels: " + images_filename + ".");
+
+        _rows = ih.dims[0];
+        _cols = 1;
+        for (size_t i=1; i<ih.dims.size(); ++i)
+            _cols *= ih.dims[i];
+        _images = _images_file.data() + ih.offset;
+        _labels = _labels_file.data() + lh.offset;
+        check_idx_labels(_labels, _rows, num_labels, labels_filename);
+    }
+
+    size_t size() const { return _rows; }
+    size_t cols() const { return _cols; }
+    size_t label(const size_t& i) const { assert(i < _rows); return _labels[i]; }
+
+    // Same normalisation as MnistDataset::from_idx
+    void copy_row(const size_t& i, T* dst) const
+    {
+        assert(i < _rows);
+        const unsigned char* src = _images + i * _cols;
+        for (size_t j=0; j<_cols; ++j)
+            dst[j] = static_cast<T>(src[j]) / static_cast<T>(255) - static_cast<T>(0.5);
+    }
+};
+
+#endif
@@ -1,4 +1,3 @@
-
 #ifndef MODULE_HPP
 #define MODULE_HPP
 
@@ -7,8 +6,15 @@
 #include<vector>
 #include<assert.h> 
 #include<cstdlib>
+#include<algorithm>
+#include<stdexcept>
 
 #include "value.hpp"
+#include "tape.hpp"
+#include "tensor.hpp"
+#include "kernels.hpp"
+#include "parameters.hpp"
+#include "dual.hpp"
 
 template <class T>
 T get_random_number(const T& min, const T& max)
@@ -41,9 +47,20 @@ class Neuron: public Module<T>
 private:
     size_t _size;
     bool _non_lin;
+    bool _packed = false; // weights are consecutive ParameterBuffer views, set by bind_parameters
     std::vector<Value<T>> _weights;
     Value<T> _bias{static_cast<T>(0)};
 
+    // Callers bind the bias first, so leaves are bound in get_parameters() order
+    std::vector<TapeValue<T>> bind_weights(Tape<T>& tape) const
+    {
+        std::vector<TapeValue<T>> rval;
+        rval.reserve(_size);
+        for (auto& w : _weights)
+            rval.push_back(tape.variable(w));
+        return rval;
+    }
+
 public:
     Neuron(const size_t& size, const bool& non_lin=true): _size{size}, _non_lin{non_lin}
     {
@@ -55,12 +72,41 @@ public:
         }
         _bias = Value<T>(get_random_number(static_cast<T>(-1), static_cast<T>(1)));
     }
-    Neuron(const Neuron& other) { _size = other._size; _weights = other._weights; _bias = other._bias; }
-    Neuron(Neuron&& other) { _size = other._size; _weights = std::move(other._weights); _bias = std::move(other._bias); }
-    Neuron& operator=(const Neuron& other) { _size = other._size; _weights = other._weights; _bias = other._bias; return *this; }
-    Neuron& operator=(Neuron&& other) { _size = other._size; _weights = std::move(other._weights); _bias = std::move(other._bias); return *this; }
+    Neuron(const Neuron& other) { _size = other._size; _non_lin = other._non_lin; _packed = other._packed; _weights = other._weights; _bias = other._bias; }
+    Neuron(Neuron&& other) { _size = other._size; _non_lin = other._non_lin; _packed = other._packed; _weights = std::move(other._weights); _bias = std::move(other._bias); }
+    Neuron& operator=(const Neuron& other) { _size = other._size; _non_lin = other._non_lin; _packed = other._packed; _weights = other._weights; _bias = other._bias; return *this; }
+    Neuron& operator=(Neuron&& other) { _size = other._size; _non_lin = other._non_lin; _packed = other._packed; _weights = std::move(other._weights); _bias = std::move(other._bias); return *this; }
     ~Neuron() { _weights.clear(); }
 
+    size_t num_parameters() const { return _size + 1; }
+
+    // Moves the parameters into data/grad[offset, offset + num_parameters()) in get_parameters() order and
+    // replaces them with views of those slots. Without copy the slots keep their values, which replace the
+    // current ones. Returns the offset after the last slot used
+    size_t bind_parameters(T* data, T* grad, size_t offset, const std::shared_ptr<void>& owner, const bool& copy=true)
+    {
+        if (copy)
+        {
+            data[offset] = _bias.get_data();
+            grad[offset] = _bias.get_grad();
+        }
+        _bias = Value<T>::view(data + offset, grad + offset, owner);
+        ++offset;
+        for (auto& w : _weights)
+        {
+            if (copy)
+            {
+                data[offset] = w.get_data();
+                grad[offset] = w.get_grad();
+            }
+            w = Value<T>::view(data + offset, grad + offset, owner);
+            ++offset;
+        }
+        _packed = _size > 0;
+        assert(!_packed || Value<T>::is_contiguous(_weights));
+        return offset;
+    }
+
     std::vector<std::shared_ptr<Value<T>>> get_parameters() const
     {
         std::vector<std::shared_ptr<Value<T>>> rval = {std::make_shared<Value<T>>(_bias)};
@@ -73,27 +119,72 @@ public:
     {
         assert(input.size() == _size);
 
-        Value<T> rval = _bias;
+        return affine(input, _weights, _bias, _packed);
+    }
+
+    Value<T> operator()(const std::vector<T>& input) const
+    {
+        assert(input.size() == _size);
+
+        Value<T> rval = affine(input, _weights, _bias, _packed);
+        return _non_lin ? rval.relu() : rval;
+    }
+
+    // Graph of plain inputs with no activation, as operator()(const std::vector<Value<T>>&) applies none
+    Value<T> affine_plain(const std::shared_ptr<const std::vector<T>>& input) const
+    {
+        assert(input->size() == _size);
+
+        return affine(input, _weights, _bias, _packed);
+    }
+
+    // Plain forward with no graph. Like operator()(const std::vector<Value<T>>&), which MLP goes through,
+    // no activation is applied
+    T predict(const std::vector<T>& input) const
+    {
+        assert(input.size() == _size);
+
+        if (_packed)
+            return _bias.get_data() + simd_dot(input.data(), &_weights[0].get_data(), _size);
+
+        T rval = _bias.get_data();
         for (size_t i=0; i<_size; ++i)
-        {
-            auto new_temp = input[i] * _weights[i];
-            rval = rval + new_temp;
-        }
+            rval += input[i] * _weights[i].get_data();
         return rval;
     }
 
-    Value<T> operator()(const std::vector<T>& input) const
+    // Forward mode, differentiating along the inputs' tangents with the parameters held constant. As predict,
+    // no activation is applied
+    template <size_t N>
+    Dual<T, N> operator()(const std::vector<Dual<T, N>>& input) const
     {
         assert(input.size() == _size);
 
-        Value<T> rval = _bias;
+        Dual<T, N> rval(_bias.get_data());
         for (size_t i=0; i<_size; ++i)
-        {
-            Value<T> temp(input[i]);
-            auto new_temp = temp * _weights[i];
-            rval = rval + new_temp;
-        }
+            rval.add_scaled(_weights[i].get_data(), input[i]);
+        return rval;
+    }
+
+    TapeValue<T> operator()(Tape<T>& tape, const std::vector<TapeValue<T>>& input) const
+    {
+        assert(input.size() == _size);
+
+        auto bias = tape.variable(_bias);
+        return affine(input, bind_weights(tape), bias);
+    }
+
+    TapeValue<T> operator()(Tape<T>& tape, const std::vector<T>& input) const
+    {
+        assert(input.size() == _size);
 
+        std::vector<TapeValue<T>> inputs;
+        inputs.reserve(_size);
+        for (auto& i : input)
+            inputs.push_back(tape.variable(i));
+
+        auto bias = tape.variable(_bias);
+        TapeValue<T> rval = affine(inputs, bind_weights(tape), bias);
         return _non_lin ? rval.relu() : rval;
     }
 };
@@ -127,6 +218,18 @@ public:
     }
     ~Layer() { _neurons.clear(); };
 
+    size_t get_size_in() const { return _size_in; }
+    size_t get_size_out() const { return _size_out; }
+    size_t num_parameters() const { return _size_out * (_size_in + 1); }
+
+    // As Neuron::bind_parameters, neuron by neuron
+    size_t bind_parameters(T* data, T* grad, size_t offset, const std::shared_ptr<void>& owner, const bool& copy=true)
+    {
+        for (auto& n : _neurons)
+            offset = n.bind_parameters(data, grad, offset, owner, copy);
+        return offset;
+    }
+
     std::vector<std::shared_ptr<Value<T>>> get_parameters() const
     {
         std::vector<std::shared_ptr<Value<T>>> rval;
@@ -155,6 +258,52 @@ public:
             rval.push_back(n(input));
         return rval;
     }
+
+    // As Neuron::affine_plain, the neurons sharing one copy of input
+    std::vector<Value<T>> affine_plain(const std::vector<T>& input) const
+    {
+        const auto shared = std::make_shared<const std::vector<T>>(input);
+        std::vector<Value<T>> rval;
+        rval.reserve(_neurons.size());
+        for (auto& n : _neurons)
+            rval.push_back(n.affine_plain(shared));
+        return rval;
+    }
+
+    std::vector<T> predict(const std::vector<T>& input) const
+    {
+        std::vector<T> rval;
+        rval.reserve(_neurons.size());
+        for (auto& n : _neurons)
+            rval.push_back(n.predict(input));
+        return rval;
+    }
+
+    template <size_t N>
+    std::vector<Dual<T, N>> operator()(const std::vector<Dual<T, N>>& input) const
+    {
+        std::vector<Dual<T, N>> rval;
+        rval.reserve(_neurons.size());
+        for (auto& n : _neurons)
+            rval.push_back(n(input));
+        return rval;
+    }
+
+    std::vector<TapeValue<T>> operator()(Tape<T>& tape, const std::vector<TapeValue<T>>& input) const
+    {
+        std::vector<TapeValue<T>> rval;
+        for (auto& n : _neurons)
+            rval.push_back(n(tape, input));
+        return rval;
+    }
+
+    std::vector<TapeValue<T>> operator()(Tape<T>& tape, const std::vector<T>& input) const
+    {
+        std::vector<TapeValue<T>> rval;
+        for (auto& n : _neurons)
+            rval.push_back(n(tape, input));
+        return rval;
+    }
 };
 
 template <class T>
@@ -162,17 +311,87 @@ class MLP: public Module<T>
 {
 private:
     std::vector<Layer<T>> _layers;
+    std::shared_ptr<ParameterBuffer<T>> _buffer;
+    size_t _checkpoint_layers = 0;
+
+    // Graph of layers [begin, end)
+    std::vector<Value<T>> forward_layers(std::vector<Value<T>> rval, const size_t& begin, const size_t& end) const
+    {
+        for (size_t l=begin; l<end; ++l)
+            rval = _layers[l](rval);
+        return rval;
+    }
+
+    // Graph of layers [first, end), checkpointed in segments if enabled
+    std::vector<Value<T>> forward(std::vector<Value<T>> rval, const size_t& first=0) const
+    {
+        if (_checkpoint_layers == 0)
+            return forward_layers(std::move(rval), first, _layers.size());
+
+        for (size_t begin=first; begin<_layers.size(); begin+=_checkpoint_layers)
+        {
+            const size_t end = std::min(begin + _checkpoint_layers, _layers.size());
+            rval = checkpoint_segment(rval, [this, begin, end](const std::vector<Value<T>>& input)
+            {
+                return forward_layers(input, begin, end);
+            });
+        }
+        return rval;
+    }
 
 public:
-    MLP(const std::vector<size_t>& sizes)
+    MLP(const std::vector<size_t>& sizes): MLP(sizes, nullptr) {}
+
+    // Takes its parameter values from buffer, laid out as get_parameters(), instead of initialising them
+    MLP(const std::vector<size_t>& sizes, std::shared_ptr<ParameterBuffer<T>> buffer): _buffer{std::move(buffer)}
     {
         for (size_t i=0; i<sizes.size()-1; ++i)
             _layers.push_back(Layer<T>(sizes[i], sizes[i+1]));
+
+        // All parameters move into one buffer, which their views keep alive
+        size_t count = 0;
+        for (auto& l : _layers)
+            count += l.num_parameters();
+
+        const bool copy = !_buffer;
+        if (copy)
+            _buffer = std::make_shared<ParameterBuffer<T>>(count);
+        if (_buffer->size() != count)
+            throw std::invalid_argument("Parameter buffer does not match the layer sizes.");
+
+        size_t offset = 0;
+        for (auto& l : _layers)
+            offset = l.bind_parameters(_buffer->data(), _buffer->grad(), offset, _buffer, copy);
+        assert(offset == count);
     }
     MLP(const MLP&) = delete;
     MLP(MLP&&) = delete;
     ~MLP() { _layers.clear(); }
 
+    // Layer widths, as passed to the constructor
+    std::vector<size_t> get_sizes() const
+    {
+        std::vector<size_t> rval;
+        if (!_layers.empty())
+            rval.push_back(_layers.front().get_size_in());
+        for (auto& l : _layers)
+            rval.push_back(l.get_size_out());
+        return rval;
+    }
+
+    // Gradient checkpointing of the Value graph, in segments of this many layers; 0, the default, turns it off.
+    // Only each segment's outputs are kept until backward, which rebuilds the segment's graph from them, so a
+    // graph holds about layers / n segment outputs plus one segment's internals at a time, for one extra
+    // forward pass. Around sqrt(layers) balances the two. The graph then refers to the model, which must
+    // outlive it, and the parameters must not change between forward and backward
+    void set_checkpointing(const size_t& layers_per_segment) { _checkpoint_layers = layers_per_segment; }
+    size_t get_checkpointing() const { return _checkpoint_layers; }
+
+    // Parameter k of get_parameters() is slot k of the buffer
+    ParameterBuffer<T>& get_buffer() { return *_buffer; }
+    const ParameterBuffer<T>& get_buffer() const { return *_buffer; }
+    size_t num_parameters() const { return _buffer->size(); }
+
     std::vector<std::shared_ptr<Value<T>>> get_parameters() const
     {
         std::vector<std::shared_ptr<Value<T>>> rval;
@@ -186,31 +405,45 @@ public:
 
     void descend_grad(const T& learning_rate=static_cast<T>(0.01))
     {
-        for (const auto& p : get_parameters())
-            p->descend_grad(learning_rate);
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::descend_grad);
+        _buffer->descend_grad(learning_rate);
     }
 
     void zero_grad()
     {
-        for (const auto& p : get_parameters())
-            p->zero_grad();
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::zero_grad);
+        _buffer->zero_grad();
     }
 
     std::vector<Value<T>> operator()(const std::vector<Value<T>>& input) const
     {
-        std::vector<Value<T>> rval = input;
-        for (auto& l : _layers)
-            rval = l(rval);
-        return rval;
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::graph_build);
+        return forward(input);
     }
 
+    // The first layer reads the plain inputs directly, so they get no leaves of their own
     std::vector<Value<T>> operator()(const std::vector<T>& input) const
     {
-        std::vector<Value<T>> rval;
-        
-        for (auto& i : input)
-            rval.push_back(Value<T>(i));
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::graph_build);
+        assert(input.size() == _layers.front().get_size_in());
 
+        return forward(_layers.front().affine_plain(input), 1);
+    }
+
+    // Inference only, computes plain values without building a graph
+    std::vector<T> predict(const std::vector<T>& input) const
+    {
+        std::vector<T> rval = input;
+        for (auto& l : _layers)
+            rval = l.predict(rval);
+        return rval;
+    }
+
+    // Forward mode, see dual.hpp. Outputs carry the derivatives along the inputs' N tangent lanes
+    template <size_t N>
+    std::vector<Dual<T, N>> operator()(const std::vector<Dual<T, N>>& input) const
+    {
+        std::vector<Dual<T, N>> rval = input;
         for (auto& l : _layers)
             rval = l(rval);
         return rval;
@@ -218,33 +451,242 @@ public:
 
     Value<T> loss(const std::vector<T>& input, const std::vector<T>& target) const
     {
-        auto output = operator()(input);
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::loss);
+        return squared_error(operator()(input), target);
+    }
+
+    // Softmax cross-entropy of the outputs, read as logits, against class label
+    Value<T> cross_entropy(const std::vector<T>& input, const size_t& label) const
+    {
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::loss);
+        return softmax_cross_entropy(operator()(input), label);
+    }
+
+    Value<T> loss(const std::vector<Value<T>>& input, const std::vector<T>& target) const
+    {
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::loss);
+        return squared_error(operator()(input), target);
+    }
+
+    // Tape engine equivalents. Parameters are bound to the tape, so backward accumulates into them as usual
+    std::vector<TapeValue<T>> operator()(Tape<T>& tape, const std::vector<TapeValue<T>>& input) const
+    {
+        std::vector<TapeValue<T>> rval = input;
+        for (auto& l : _layers)
+            rval = l(tape, rval);
+        return rval;
+    }
+
+    // Input is read from get_sizes()[0] contiguous values, which the tape remembers for replay
+    std::vector<TapeValue<T>> operator()(Tape<T>& tape, const T* input) const
+    {
+        const size_t size_in = _layers.front().get_size_in();
+        std::vector<TapeValue<T>> rval;
+        rval.reserve(size_in);
+
+        for (size_t i=0; i<size_in; ++i)
+            rval.push_back(tape.input(input + i));
+
+        for (auto& l : _layers)
+            rval = l(tape, rval);
+        return rval;
+    }
+
+    std::vector<TapeValue<T>> operator()(Tape<T>& tape, const std::vector<T>& input) const
+    {
+        assert(input.size() == _layers.front().get_size_in());
+        return operator()(tape, input.data());
+    }
+
+    TapeValue<T> loss(Tape<T>& tape, const T* input, const T* target) const
+    {
+        return squared_error(operator()(tape, input), target);
+    }
+
+    TapeValue<T> loss(Tape<T>& tape, const std::vector<T>& input, const std::vector<T>& target) const
+    {
+        assert(target.size() == _layers.back().get_size_out());
+        return loss(tape, input.data(), target.data());
+    }
+};
+
+// Snapshot of an MLP's parameters as one contiguous row-major [size_out, size_in] weight block and a bias
+// vector per layer, for batched inference. Computes the same outputs as MLP::predict, so no relu is applied.
+// The snapshot does not follow later updates to the model
+template <class T>
+class PackedMLP
+{
+private:
+    std::vector<size_t> _sizes;
+    std::vector<std::vector<T>> _weights;
+    std::vector<std::vector<T>> _biases;
+
+public:
+    using value_type = T;
+    using workspace_type = std::vector<T>;
+
+    PackedMLP(const MLP<T>& model): _sizes{model.get_sizes()}
+    {
+        // get_parameters() is ordered layer by layer, neuron by neuron, as bias then weights
+        const auto params = model.get_parameters();
+        size_t k = 0;
+        for (size_t l=0; l+1<_sizes.size(); ++l)
+        {
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+            _weights.push_back(std::vector<T>(size_in * size_out));
+            _biases.push_back(std::vector<T>(size_out));
+            for (size_t j=0; j<size_out; ++j)
+            {
+                _biases[l][j] = params[k++]->get_data();
+                for (size_t i=0; i<size_in; ++i)
+                    _weights[l][j * size_in + i] = params[k++]->get_data();
+            }
+        }
+        assert(k == params.size());
+    }
+
+    const std::vector<size_t>& get_sizes() const { return _sizes; }
+    const std::vector<T>& get_weights(const size_t& layer) const { return _weights[layer]; }
+    const std::vector<T>& get_bias(const size_t& layer) const { return _biases[layer]; }
+
+    // Forward for count contiguous inputs of get_sizes().front() values each. The outputs are count rows of
+    // get_sizes().back() values held in workspace, which is resized as needed and can be reused across calls
+    const T* forward(const T* inputs, const size_t& count, std::vector<T>& workspace) const
+    {
+        const size_t width = *std::max_element(_sizes.begin() + 1, _sizes.end());
+        if (workspace.size() < 2 * count * width)
+            workspace.resize(2 * count * width);
 
-        Value<T> rval = Value<T>(static_cast<T>(0));
-        for (size_t i=0; i<output.size(); ++i)
+        const T* in = inputs;
+        T* out = workspace.data();
+        for (size_t l=0; l<_weights.size(); ++l)
         {
-            auto target_value = Value<T>(target[i]);
-            auto diff = output[i] - target_value;
-            auto temp_loss = pow(diff, static_cast<T>(2));
-            rval = rval + temp_loss;
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+
+            // Each weight row is reused across the whole batch while it is in cache
+            for (size_t j=0; j<size_out; ++j)
+            {
+                const T* w = _weights[l].data() + j * size_in;
+                for (size_t b=0; b<count; ++b)
+                    out[b * size_out + j] = _biases[l][j] + simd_dot(in + b * size_in, w, size_in);
+            }
+
+            in = out;
+            out = (out == workspace.data()) ? workspace.data() + count * width : workspace.data();
         }
-        return rval;
+        return in;
     }
+};
 
-    Value<T> loss(const std::vector<Value<T>>& input, const std::vector<T>& target) const
+// Tensor-backed dense layer. Weights are a single [size_in, size_out] tensor, so the forward is one matmul node
+// and one broadcast add node rather than size_in*size_out scalar nodes
+template <class T>
+class TensorLayer
+{
+private:
+    size_t _size_in, _size_out;
+    bool _non_lin;
+    Tensor<T> _weights;
+    Tensor<T> _bias;
+
+public:
+    TensorLayer(const size_t& size_in, const size_t& size_out, const bool& non_lin=true):
+    _size_in{size_in}, _size_out{size_out}, _non_lin{non_lin},
+    _weights{std::vector<size_t>{size_in, size_out}}, _bias{std::vector<size_t>{size_out}}
+    {
+        constexpr T max = static_cast<T>(1);
+        constexpr T min = static_cast<T>(-1);
+        for (auto& w : _weights.get_data())
+            w = get_random_number(min, max)/static_cast<T>(size_in);
+        for (auto& b : _bias.get_data())
+            b = get_random_number(min, max);
+    }
+
+    std::vector<Tensor<T>> get_parameters() const { return {_weights, _bias}; }
+
+    // Accepts a single [size_in] sample or a [batch, size_in] batch
+    Tensor<T> operator()(const Tensor<T>& input) const
+    {
+        assert(input.get_shape().back() == _size_in);
+
+        auto rval = matmul(input, _weights) + _bias;
+        return _non_lin ? rval.relu() : rval;
+    }
+};
+
+// Tensor-backed MLP. Every layer is affine with no activation, as in MLP, so both compute the same function
+template <class T>
+class TensorMLP
+{
+private:
+    std::vector<TensorLayer<T>> _layers;
+
+public:
+    TensorMLP(const std::vector<size_t>& sizes)
     {
-        std::vector<Value<T>> output = operator()(input);
+        for (size_t i=0; i<sizes.size()-1; ++i)
+            _layers.push_back(TensorLayer<T>(sizes[i], sizes[i+1], false));
+    }
+    TensorMLP(const TensorMLP&) = delete;
+    TensorMLP(TensorMLP&&) = delete;
+    ~TensorMLP() { _layers.clear(); }
 
-        Value<T> rval(static_cast<T>(0));
-        for (size_t i=0; i<output.size(); ++i)
+    std::vector<Tensor<T>> get_parameters() const
+    {
+        std::vector<Tensor<T>> rval;
+        for (auto& l : _layers)
         {
-            auto target_value = Value<T>(target[i]);
-            auto diff = output[i] - target_value;
-            auto temp_loss = pow(diff, static_cast<T>(2));
-            rval = rval + temp_loss;
+            auto temp = l.get_parameters();
+            rval.insert(rval.end(), temp.begin(), temp.end());
         }
         return rval;
     }
+
+    void descend_grad(const T& learning_rate=static_cast<T>(0.01))
+    {
+        for (const auto& p : get_parameters())
+            p.descend_grad(learning_rate);
+    }
+
+    void zero_grad()
+    {
+        for (const auto& p : get_parameters())
+            p.zero_grad();
+    }
+
+    Tensor<T> operator()(const Tensor<T>& input) const
+    {
+        Tensor<T> rval = input;
+        for (auto& l : _layers)
+            rval = l(rval);
+        return rval;
+    }
+
+    Tensor<T> operator()(const std::vector<T>& input) const
+    {
+        return operator()(Tensor<T>({input.size()}, input));
+    }
+
+    std::vector<T> predict(const std::vector<T>& input) const
+    {
+        NoGradGuard guard;
+        return operator()(input).get_data();
+    }
+
+    Tensor<T> loss(const std::vector<T>& input, const std::vector<T>& target) const
+    {
+        auto diff = operator()(input) - Tensor<T>({target.size()}, target);
+        return sum(pow(diff, static_cast<T>(2)));
+    }
+
+    // Summed loss over a batch, computed with one matmul per layer
+    Tensor<T> loss(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>& targets) const
+    {
+        auto diff = operator()(stack_rows(inputs)) - stack_rows(targets);
+        return sum(pow(diff, static_cast<T>(2)));
+    }
 };
 
 #endif
\ No newline at end of file
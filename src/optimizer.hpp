@@ -0,0 +1,182 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include<vector>
+#include<cmath>
+#include<algorithm>
+
+#include "parameters.hpp"
+#include "thread_pool.hpp"
+
+// Update rules over a ParameterBuffer. Any state is held in arrays parallel to the buffer, so a step is a
+// single pass of plain loops over contiguous memory, which the compiler vectorises. Given a ThreadPool, a
+// step over a large enough buffer is split into one contiguous range per thread.
+template <class T>
+class Optimizer
+{
+protected:
+    ParameterBuffer<T>& _params;
+    ThreadPool* _pool;
+    T _learning_rate;
+    size_t _steps = 0;
+
+    // Below this many parameters per thread a step runs on the calling thread
+    static constexpr size_t min_chunk = 1 << 14;
+
+public:
+    Optimizer(ParameterBuffer<T>& params, const T& learning_rate, ThreadPool* pool=nullptr):
+    _params{params}, _pool{pool}, _learning_rate{learning_rate}
+    {}
+    Optimizer(const Optimizer&) = delete;
+    Optimizer& operator=(const Optimizer&) = delete;
+    virtual ~Optimizer() = default;
+
+    // Getters and setters
+    T get_learning_rate() const { return _learning_rate; }
+    void set_learning_rate(const T& learning_rate) { _learning_rate = learning_rate; }
+    size_t get_steps() const { return _steps; }
+    void set_steps(const size_t& steps) { _steps = steps; }
+    const ParameterBuffer<T>& get_buffer() const { return _params; }
+
+    // State arrays, each parallel to the buffer, for checkpointing
+    virtual std::vector<std::vector<T>*> get_state() { return {}; }
+
+    // Applies the update of the current step to parameters [begin, end). For callers that split the work
+    // themselves, after begin_step()
+    virtual void update(const size_t& begin, const size_t& end) = 0;
+    void begin_step() { ++_steps; }
+
+    void step()
+    {
+        begin_step();
+
+        const size_t size = _params.size();
+        const size_t chunks = _pool ? std::min(_pool->size(), std::max<size_t>(1, size / min_chunk)) : 1;
+        if (chunks <= 1)
+        {
+            update(0, size);
+            return;
+        }
+        _pool->parallel_for(chunks, [&](size_t chunk)
+        {
+            update(chunk * size / chunks, (chunk + 1) * size / chunks);
+        });
+    }
+
+    void zero_grad() { _params.zero_grad(); }
+};
+
+// SGD with optional momentum and L2 weight decay. With momentum 0 this is the plain descend_grad rule
+template <class T>
+class SGD: public Optimizer<T>
+{
+private:
+    T _momentum;
+    T _weight_decay;
+    std::vector<T> _velocity;
+
+public:
+    SGD(ParameterBuffer<T>& params, const T& learning_rate, const T& momentum=static_cast<T>(0),
+        const T& weight_decay=static_cast<T>(0), ThreadPool* pool=nullptr):
+    Optimizer<T>(params, learning_rate, pool), _momentum{momentum}, _weight_decay{weight_decay},
+    _velocity(momentum != static_cast<T>(0) ? params.size() : 0, static_cast<T>(0))
+    {}
+
+    std::vector<std::vector<T>*> get_state()
+    {
+        if (_velocity.empty())
+            return {};
+        return {&_velocity};
+    }
+
+    void update(const size_t& begin, const size_t& end)
+    {
+        T* data = this->_params.data();
+        const T* grad = this->_params.grad();
+        const T lr = this->_learning_rate;
+        const T mu = _momentum;
+        const T wd = _weight_decay;
+
+        if (_velocity.empty())
+        {
+            for (size_t i=begin; i<end; ++i)
+                data[i] -= lr * (grad[i] + wd * data[i]);
+            return;
+        }
+
+        T* vel = _velocity.data();
+        for (size_t i=begin; i<end; ++i)
+        {
+            vel[i] = mu * vel[i] + grad[i] + wd * data[i];
+            data[i] -= lr * vel[i];
+        }
+    }
+};
+
+// Adam (Kingma & Ba). With decoupled set it is AdamW (Loshchilov & Hutter): weight decay shrinks the
+// parameters directly instead of being added to the gradient
+template <class T>
+class Adam: public Optimizer<T>
+{
+private:
+    T _beta1;
+    T _beta2;
+    T _eps;
+    T _weight_decay;
+    bool _decoupled;
+    std::vector<T> _m;
+    std::vector<T> _v;
+
+public:
+    Adam(ParameterBuffer<T>& params, const T& learning_rate=static_cast<T>(0.001), const T& beta1=static_cast<T>(0.9),
+        const T& beta2=static_cast<T>(0.999), const T& eps=static_cast<T>(1e-8), const T& weight_decay=static_cast<T>(0),
+        const bool& decoupled=false, ThreadPool* pool=nullptr):
+    Optimizer<T>(params, learning_rate, pool), _beta1{beta1}, _beta2{beta2}, _eps{eps},
+    _weight_decay{weight_decay}, _decoupled{decoupled},
+    _m(params.size(), static_cast<T>(0)), _v(params.size(), static_cast<T>(0))
+    {}
+
+    // First and second moment estimates, parallel to the buffer
+    const std::vector<T>& get_first_moment() const { return _m; }
+    const std::vector<T>& get_second_moment() const { return _v; }
+    std::vector<std::vector<T>*> get_state() { return {&_m, &_v}; }
+
+    void update(const size_t& begin, const size_t& end)
+    {
+        T* data = this->_params.data();
+        const T* grad = this->_params.grad();
+        T* m = _m.data();
+        T* v = _v.data();
+
+        const T b1 = _beta1;
+        const T b2 = _beta2;
+        const T eps = _eps;
+        const T t = static_cast<T>(std::max<size_t>(this->_steps, 1));
+
+        // Bias corrections folded into the step size
+        const T lr = this->_learning_rate * std::sqrt(static_cast<T>(1) - std::pow(b2, t)) / (static_cast<T>(1) - std::pow(b1, t));
+        const T l2 = _decoupled ? static_cast<T>(0) : _weight_decay;
+        const T shrink = _decoupled ? static_cast<T>(1) - this->_learning_rate * _weight_decay : static_cast<T>(1);
+
+        for (size_t i=begin; i<end; ++i)
+        {
+            const T g = grad[i] + l2 * data[i];
+            m[i] = b1 * m[i] + (static_cast<T>(1) - b1) * g;
+            v[i] = b2 * v[i] + (static_cast<T>(1) - b2) * g * g;
+            data[i] = shrink * data[i] - lr * m[i] / (std::sqrt(v[i]) + eps);
+        }
+    }
+};
+
+template <class T>
+class AdamW: public Adam<T>
+{
+public:
+    AdamW(ParameterBuffer<T>& params, const T& learning_rate=static_cast<T>(0.001), const T& weight_decay=static_cast<T>(0.01),
+        const T& beta1=static_cast<T>(0.9), const T& beta2=static_cast<T>(0.999), const T& eps=static_cast<T>(1e-8),
+        ThreadPool* pool=nullptr):
+    Adam<T>(params, learning_rate, beta1, beta2, eps, weight_decay, true, pool)
+    {}
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PARAMETERS_HPP
+#define PARAMETERS_HPP
+
+#include<vector>
+#include<cstring>
+#include<cstdint>
+#include<assert.h>
+
+#include "kernels.hpp"
+#include "mapped_file.hpp"
+
+// Contiguous storage for a model's parameters, one array of values and one of gradients, in get_parameters()
+// order. Parameter Values are views into it, so whole-model operations are single loops over the arrays and
+// the arrays can be handed to optimisers, serialisers and reducers without copying. The values may instead live
+// in a copy-on-write file mapping, such as a loaded checkpoint, and are then used in place
+template <class T>
+class ParameterBuffer
+{
+private:
+    std::vector<T> _owned;
+    MappedFile _file;
+    T* _data;
+    size_t _size;
+    std::vector<T> _grad;
+
+public:
+    ParameterBuffer(const size_t& size):
+    _owned(size, static_cast<T>(0)), _data{_owned.data()}, _size{size}, _grad(size, static_cast<T>(0))
+    {}
+
+    // Values are the size elements at byte offset in a writable mapping, which must be suitably aligned
+    ParameterBuffer(MappedFile file, const size_t& offset, const size_t& size):
+    _file{std::move(file)}, _data{reinterpret_cast<T*>(_file.data() + offset)}, _size{size}, _grad(size, static_cast<T>(0))
+    {
+        assert(offset + size * sizeof(T) <= _file.size());
+        assert(reinterpret_cast<uintptr_t>(_data) % alignof(T) == 0);
+    }
+
+    // Pinned in place: parameter views hold raw pointers into the arrays, and a copy or move would leave them
+    // reading the old storage. Owners that need to move keep it behind a pointer, as MLP does. Other types
+    // that hand out pointers or handles into themselves, such as Tape and ExecutionPlan, are pinned the same way
+    ParameterBuffer(const ParameterBuffer&) = delete;
+    ParameterBuffer(ParameterBuffer&&) = delete;
+    ParameterBuffer& operator=(const ParameterBuffer&) = delete;
+    ParameterBuffer& operator=(ParameterBuffer&&) = delete;
+
+    // Getters
+    size_t size() const { return _size; }
+    T* data() { return _data; }
+    T* grad() { return _grad.data(); }
+    const T* data() const { return _data; }
+    const T* grad() const { return _grad.data(); }
+    bool is_mapped() const { return _file.is_open(); }
+
+    void zero_grad()
+    {
+        if (!_grad.empty())
+            std::memset(_grad.data(), 0, _grad.size() * sizeof(T));
+    }
+
+    // data -= learning_rate * grad
+    void descend_grad(const T& learning_rate)
+    {
+        simd_axpy(-learning_rate, _grad.data(), _data, _size);
+    }
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef PLAN_HPP
+#define PLAN_HPP
+
+#include<vector>
+#include<atomic>
+#include<algorithm>
+#include<assert.h>
+
+#include "value.hpp"
+#include "tape.hpp"
+#include "module.hpp"
+
+// Training graph of an MLP captured once and replayed for every sample. The loss is recorded on a
+// Tape whose input and target leaves read from buffers owned by the plan, which fixes the op list,
+// the value/grad arena and the reverse order up front. A step copies the new sample into those
+// buffers, re-evaluates the entries in place and sweeps back over them, so nothing is allocated
+// after construction. The MLP graph does not depend on the data, so the capture is valid for any
+// sample of the same shape.
+template <class T>
+class ExecutionPlan
+{
+private:
+    std::vector<T> _input;
+    std::vector<T> _target;
+    Tape<T> _tape;
+    size_t _root;
+
+public:
+    ExecutionPlan(const MLP<T>& model):
+    _input(model.get_sizes().front(), static_cast<T>(0)), _target(model.get_sizes().back(), static_cast<T>(0))
+    {
+        _root = model.loss(_tape, _input.data(), _target.data()).get_index();
+    }
+
+    // Pinned, as explained on ParameterBuffer, since the tape's input leaves point into _input and _target
+    ExecutionPlan(const ExecutionPlan&) = delete;
+    ExecutionPlan(ExecutionPlan&&) = delete;
+    ExecutionPlan& operator=(const ExecutionPlan&) = delete;
+    ExecutionPlan& operator=(ExecutionPlan&&) = delete;
+
+    // Getters
+    size_t size() const { return _tape.size(); }
+    size_t get_root() const { return _root; }
+    const Tape<T>& get_tape() const { return _tape; }
+
+    // Loss for one sample with the current parameter values
+    T forward(const T* input, const T* target)
+    {
+        std::copy(input, input + _input.size(), _input.begin());
+        std::copy(target, target + _target.size(), _target.begin());
+        _tape.replay();
+        return _tape[_root].data;
+    }
+
+    // Forward and reverse sweep. Parameter grads are left on the bound leaves of get_tape()
+    T sweep(const T* input, const T* target)
+    {
+        T rval = forward(input, target);
+        _tape.sweep(_root);
+        return rval;
+    }
+
+    // As above, reading parameter k from params[k] rather than from the model, see Tape::replay
+    T sweep(const T* input, const T* target, const std::atomic<T>* params)
+    {
+        std::copy(input, input + _input.size(), _input.begin());
+        std::copy(target, target + _target.size(), _target.begin());
+        _tape.replay(params);
+        _tape.sweep(_root);
+        return _tape[_root].data;
+    }
+
+    // Forward and backward, accumulating into the parameters' grads
+    T backward(const T* input, const T* target)
+    {
+        T rval = forward(input, target);
+        _tape.backward(_root);
+        return rval;
+    }
+};
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include<iostream>
+#include<fstream>
+#include<string>
+#include<vector>
+#include<array>
+#include<memory>
+#include<mutex>
+#include<atomic>
+#include<chrono>
+#include<stdexcept>
+
+// Autograd profiler. The hooks in the library are only compiled in when CPP_GRAD_PROFILE is defined, and
+// then also only record while Profiler::set_enabled(true) is in effect. Without the define they expand to
+// nothing, so a normal build pays nothing for them.
+//
+// It counts nodes created per op type with an estimate of the bytes allocated for them, and times the
+// main phases of a step. end_step() prints and resets the per-step counters; every timed region is also
+// kept as an event for write_trace(), which writes the Chrome trace-event format (chrome://tracing or
+// Perfetto). Events are buffered per thread, so recording takes no shared lock, and each thread keeps at
+// most get_max_events() of them; later ones are dropped and counted.
+
+enum class ProfOp : unsigned char
+{
+    leaf,
+    view,
+    add,
+    sub,
+    mul,
+    pow,
+    relu,
+    affine,
+    affine_plain,
+    fused,
+    segment,
+    squared_error,
+    cross_entropy,
+    count
+};
+
+enum class ProfRegion : unsigned char
+{
+    graph_build,
+    loss,
+    build_topo,
+    backward,
+    tape_sweep,
+    descend_grad,
+    zero_grad,
+    count
+};
+
+inline const char* prof_name(const ProfOp& op)
+{
+    static const char* names[] = {"leaf", "view", "add", "sub", "mul", "pow", "relu", "affine", "affine_plain", "fused",
+                                  "segment", "squared_error", "cross_entropy"};
+    return names[static_cast<size_t>(op)];
+}
+
+inline const char* prof_name(const ProfRegion& region)
+{
+    static const char* names[] = {"graph_build", "loss", "build_topo", "backward", "tape_sweep", "descend_grad", "zero_grad"};
+    return names[static_cast<size_t>(region)];
+}
+
+class Profiler
+{
+private:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr size_t num_ops = static_cast<size_t>(ProfOp::count);
+    static constexpr size_t num_regions = static_cast<size_t>(ProfRegion::count);
+
+    struct Event
+    {
+        ProfRegion region;
+        double start_us;
+        double duration_us;
+    };
+
+    // Events of one thread. Only that thread appends, so the lock is uncontended except while the events
+    // are written out or cleared. Buffers outlive their threads, so pool threads that exit still show up
+    struct ThreadEvents
+    {
+        size_t thread;
+        std::mutex mutex;
+        std::vector<Event> events;
+        size_t dropped = 0;
+    };
+
+    // Step counters are updated from any thread
+    std::atomic<bool> _enabled{false};
+    std::array<std::atomic<size_t>, num_ops> _nodes{};
+    std::atomic<size_t> _bytes{0};
+    std::array<std::atomic<size_t>, num_regions> _calls{};
+    std::array<std::atomic<double>, num_regions> _times_us{};
+    size_t _step = 0;
+
+    // Guards the list of buffers, not their contents, and the step marks
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<ThreadEvents>> _threads;
+    std::atomic<size_t> _max_events{size_t(1) << 18};
+    std::vector<std::pair<double, size_t>> _step_marks;
+    const clock::time_point _origin = clock::now();
+
+    Profiler() = default;
+
+    // Registered on the thread's first event
+    ThreadEvents& local_events()
+    {
+        static thread_local ThreadEvents* local = nullptr;
+        if (!local)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _threads.push_back(std::make_unique<ThreadEvents>());
+            local = _threads.back().get();
+            local->thread = _threads.size() - 1;
+        }
+        return *local;
+    }
+
+    static void add(std::atomic<double>& total, const double& value)
+    {
+        double old = total.load(std::memory_order_relaxed);
+        while (!total.compare_exchange_weak(old, old + value, std::memory_order_relaxed));
+    }
+
+public:
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    static Profiler& instance()
+    {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    bool is_enabled() const { return _enabled.load(std::memory_order_relaxed); }
+    void set_enabled(const bool& value) { _enabled.store(value, std::memory_order_relaxed); }
+
+    double now_us() const { return std::chrono::duration<double, std::micro>(clock::now() - _origin).count(); }
+
+    // Cap on the events kept per thread, about 24 bytes each. Counters and region times are unaffected
+    size_t get_max_events() const { return _max_events.load(std::memory_order_relaxed); }
+    void set_max_events(const size_t& value) { _max_events.store(value, std::memory_order_relaxed); }
+
+    void count_node(const ProfOp& op, const size_t& bytes)
+    {
+        _nodes[static_cast<size_t>(op)].fetch_add(1, std::memory_order_relaxed);
+        _bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void record(const ProfRegion& region, const double& start_us, const double& end_us)
+    {
+        _calls[static_cast<size_t>(region)].fetch_add(1, std::memory_order_relaxed);
+        add(_times_us[static_cast<size_t>(region)], end_us - start_us);
+
+        ThreadEvents& local = local_events();
+        std::lock_guard<std::mutex> lock(local.mutex);
+        if (local.events.size() < get_max_events())
+            local.events.push_back({region, start_us, end_us - start_us});
+        else
+            ++local.dropped;
+    }
+
+    // Getters for the current step
+    size_t get_nodes(const ProfOp& op) const { return _nodes[static_cast<size_t>(op)].load(std::memory_order_relaxed); }
+    size_t get_bytes() const { return _bytes.load(std::memory_order_relaxed); }
+    size_t get_calls(const ProfRegion& region) const { return _calls[static_cast<size_t>(region)].load(std::memory_order_relaxed); }
+    double get_time_us(const ProfRegion& region) const { return _times_us[static_cast<size_t>(region)].load(std::memory_order_relaxed); }
+
+    // Events dropped over the cap since the last clear(), over all threads
+    size_t get_dropped()
+    {
+        size_t rval = 0;
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& t : _threads)
+        {
+            std::lock_guard<std::mutex> local_lock(t->mutex);
+            rval += t->dropped;
+        }
+        return rval;
+    }
+
+    // Prints the counters for the step just finished and resets them. Region times are inclusive, so nested
+    // regions (graph_build inside loss) are also counted in their parent
+    void end_step(std::ostream& os=std::cout)
+    {
+        size_t total = 0;
+        for (size_t i=0; i<num_ops; ++i)
+            total += get_nodes(static_cast<ProfOp>(i));
+
+        os << "Step " << _step << ": " << total << " nodes (";
+        for (size_t i=0; i<num_ops; ++i)
+            os << prof_name(static_cast<ProfOp>(i)) << " " << get_nodes(static_cast<ProfOp>(i)) << (i+1 < num_ops ? ", " : "");
+        os << "), " << get_bytes() / 1024 << " KiB" << std::endl;
+
+        for (size_t i=0; i<num_regions; ++i)
+        {
+            const ProfRegion region = static_cast<ProfRegion>(i);
+            if (get_calls(region) > 0)
+                os << "  " << prof_name(region) << ": " << get_time_us(region) / 1e3 << " ms over " << get_calls(region) << " calls" << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _step_marks.push_back({now_us(), total});
+        }
+        reset_counters();
+        ++_step;
+    }
+
+    void reset_counters()
+    {
+        for (auto& n : _nodes)
+            n.store(0, std::memory_order_relaxed);
+        _bytes.store(0, std::memory_order_relaxed);
+        for (auto& c : _calls)
+            c.store(0, std::memory_order_relaxed);
+        for (auto& t : _times_us)
+            t.store(0.0, std::memory_order_relaxed);
+    }
+
+    // Drops recorded events and step marks as well as the counters
+    void clear()
+    {
+        reset_counters();
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& t : _threads)
+        {
+            std::lock_guard<std::mutex> local_lock(t->mutex);
+            t->events.clear();
+            t->dropped = 0;
+        }
+        _step_marks.clear();
+        _step = 0;
+    }
+
+    // Chrome trace-event JSON: one complete event per kept timed region and a node counter per step. The
+    // number of dropped events goes in otherData
+    void write_trace(const std::string& filename)
+    {
+        std::ofstream file(filename);
+        if (!file.is_open())
+            throw std::runtime_error("Error opening file: " + filename + ".");
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        file << "{\"traceEvents\": [\n";
+        bool first = true;
+        size_t dropped = 0;
+        for (auto& t : _threads)
+        {
+            std::lock_guard<std::mutex> local_lock(t->mutex);
+            dropped += t->dropped;
+            for (auto& e : t->events)
+            {
+                file << (first ? "" : ",\n") << "{\"name\": \"" << prof_name(e.region) << "\", \"cat\": \"autograd\", \"ph\": \"X\", \"ts\": "
+                     << e.start_us << ", \"dur\": " << e.duration_us << ", \"pid\": 0, \"tid\": " << t->thread << "}";
+                first = false;
+            }
+        }
+        for (auto& m : _step_marks)
+        {
+            file << (first ? "" : ",\n") << "{\"name\": \"nodes\", \"ph\": \"C\", \"ts\": " << m.first
+                 << ", \"pid\": 0, \"args\": {\"nodes\": " << m.second << "}}";
+            first = false;
+        }
+        file << "\n], \"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": " << dropped << "}}\n";
+    }
+};
+
+// Times the enclosing scope when the profiler is enabled
+class ProfScope
+{
+private:
+    ProfRegion _region;
+    double _start;
+    bool _active;
+
+public:
+    ProfScope(const ProfRegion& region):
+    _region{region}, _start{0.0}, _active{Profiler::instance().is_enabled()}
+    {
+        if (_active)
+            _start = Profiler::instance().now_us();
+    }
+    ~ProfScope()
+    {
+        if (_active)
+            Profiler::instance().record(_region, _start, Profiler::instance().now_us());
+    }
+
+    ProfScope(const ProfScope&) = delete;
+    ProfScope& operator=(const ProfScope&) = delete;
+};
+
+#ifdef CPP_GRAD_PROFILE
+#define CPP_GRAD_PROF_CAT2(a, b) a##b
+#define CPP_GRAD_PROF_CAT(a, b) CPP_GRAD_PROF_CAT2(a, b)
+#define CPP_GRAD_PROFILE_SCOPE(region) ProfScope CPP_GRAD_PROF_CAT(_prof_scope_, __LINE__)(region)
+#define CPP_GRAD_PROFILE_NODE(op, bytes) \
+    do { if (Profiler::instance().is_enabled()) Profiler::instance().count_node(op, bytes); } while (0)
+#else
+#define CPP_GRAD_PROFILE_SCOPE(region) ((void)0)
+#define CPP_GRAD_PROFILE_NODE(op, bytes) ((void)0)
+#endif
+
+#endif
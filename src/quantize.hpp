@@ -0,0 +1,417 @@
+#ifndef QUANTIZE_HPP
+#define QUANTIZE_HPP
+
+#include<vector>
+#include<cmath>
+#include<cstdint>
+#include<algorithm>
+#include<assert.h>
+
+#include "kernels.hpp"
+#include "module.hpp"
+
+// Reduced-precision snapshots of a PackedMLP. They share its interface (value_type, workspace_type,
+// get_sizes and forward), so they run through evaluate_packed the same way. Activations and biases are float
+// throughout and every dot product accumulates in float or int32, so only the weight storage is narrowed.
+// ReducedMLP and QuantizedMLP are inference only; MixedPrecisionMLP also trains with its weights narrowed.
+
+// Weight storage tags for ReducedMLP
+struct bfloat16
+{
+    uint16_t bits;
+};
+
+template <class W>
+struct ReducedStorage;
+
+template <>
+struct ReducedStorage<float>
+{
+    using type = float;
+    static type encode(const float& x) { return x; }
+    static float dot(const float* x, const type* w, const size_t& n) { return simd_dot(x, w, n); }
+    static void axpy(const float& a, const type* w, float* y, const size_t& n) { simd_axpy(a, w, y, n); }
+};
+
+template <>
+struct ReducedStorage<bfloat16>
+{
+    using type = uint16_t;
+    static type encode(const float& x) { return float_to_bf16(x); }
+    static float dot(const float* x, const type* w, const size_t& n) { return simd_dot_bf16(x, w, n); }
+    static void axpy(const float& a, const type* w, float* y, const size_t& n) { simd_axpy_bf16(a, w, y, n); }
+};
+
+// Weights stored as W (float or bfloat16), float biases and activations
+template <class W>
+class ReducedMLP
+{
+private:
+    using storage = ReducedStorage<W>;
+
+    std::vector<size_t> _sizes;
+    std::vector<std::vector<typename storage::type>> _weights;
+    std::vector<std::vector<float>> _biases;
+
+public:
+    using value_type = float;
+    using workspace_type = std::vector<float>;
+
+    template <class T>
+    ReducedMLP(const PackedMLP<T>& packed): _sizes{packed.get_sizes()}
+    {
+        for (size_t l=0; l+1<_sizes.size(); ++l)
+        {
+            const auto& w = packed.get_weights(l);
+            const auto& b = packed.get_bias(l);
+            _weights.push_back(std::vector<typename storage::type>(w.size()));
+            for (size_t i=0; i<w.size(); ++i)
+                _weights[l][i] = storage::encode(static_cast<float>(w[i]));
+            _biases.push_back(std::vector<float>(b.begin(), b.end()));
+        }
+    }
+
+    const std::vector<size_t>& get_sizes() const { return _sizes; }
+
+    // Bytes held by the weights and biases
+    size_t num_bytes() const
+    {
+        size_t rval = 0;
+        for (size_t l=0; l<_weights.size(); ++l)
+            rval += _weights[l].size() * sizeof(typename storage::type) + _biases[l].size() * sizeof(float);
+        return rval;
+    }
+
+    // As PackedMLP::forward
+    const float* forward(const float* inputs, const size_t& count, std::vector<float>& workspace) const
+    {
+        const size_t width = *std::max_element(_sizes.begin() + 1, _sizes.end());
+        if (workspace.size() < 2 * count * width)
+            workspace.resize(2 * count * width);
+
+        const float* in = inputs;
+        float* out = workspace.data();
+        for (size_t l=0; l<_weights.size(); ++l)
+        {
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+
+            for (size_t j=0; j<size_out; ++j)
+            {
+                const auto* w = _weights[l].data() + j * size_in;
+                for (size_t b=0; b<count; ++b)
+                    out[b * size_out + j] = _biases[l][j] + storage::dot(in + b * size_in, w, size_in);
+            }
+
+            in = out;
+            out = (out == workspace.data()) ? workspace.data() + count * width : workspace.data();
+        }
+        return in;
+    }
+};
+
+// Mixed-precision training. The forward and backward passes read weights stored as W (float or bfloat16)
+// while activations, gradients and every accumulation stay in float. Updates go to a float master copy and
+// the working weights are re-encoded from it after each step, so rounding to W never builds up across steps
+// and updates smaller than a bfloat16 ulp are not lost. Layers are affine with no activation, as in MLP, and
+// the loss is the summed squared error of MLP::loss
+template <class W>
+class MixedPrecisionMLP
+{
+private:
+    using storage = ReducedStorage<W>;
+
+    std::vector<size_t> _sizes;
+    std::vector<std::vector<float>> _master;
+    std::vector<std::vector<typename storage::type>> _weights;
+    std::vector<std::vector<float>> _biases;
+    std::vector<std::vector<float>> _weight_grads;
+    std::vector<std::vector<float>> _bias_grads;
+
+    void encode_layer(const size_t& l)
+    {
+        for (size_t i=0; i<_master[l].size(); ++i)
+            _weights[l][i] = storage::encode(_master[l][i]);
+    }
+
+public:
+    // Per layer activations for the backward pass and the running error terms
+    struct TrainWorkspace
+    {
+        std::vector<std::vector<float>> activations;
+        std::vector<float> delta;
+        std::vector<float> delta_in;
+    };
+
+    using value_type = float;
+    using workspace_type = std::vector<float>;
+
+    template <class T>
+    MixedPrecisionMLP(const PackedMLP<T>& packed): _sizes{packed.get_sizes()}
+    {
+        for (size_t l=0; l+1<_sizes.size(); ++l)
+        {
+            const auto& w = packed.get_weights(l);
+            const auto& b = packed.get_bias(l);
+            _master.push_back(std::vector<float>(w.begin(), w.end()));
+            _weights.push_back(std::vector<typename storage::type>(w.size()));
+            encode_layer(l);
+            _biases.push_back(std::vector<float>(b.begin(), b.end()));
+            _weight_grads.push_back(std::vector<float>(w.size(), 0.0f));
+            _bias_grads.push_back(std::vector<float>(b.size(), 0.0f));
+        }
+    }
+
+    const std::vector<size_t>& get_sizes() const { return _sizes; }
+
+    // Bytes read by the forward and backward passes, as ReducedMLP::num_bytes. The master copy and gradients
+    // are float on top of this
+    size_t num_bytes() const
+    {
+        size_t rval = 0;
+        for (size_t l=0; l<_weights.size(); ++l)
+            rval += _weights[l].size() * sizeof(typename storage::type) + _biases[l].size() * sizeof(float);
+        return rval;
+    }
+
+    // As PackedMLP::forward
+    const float* forward(const float* inputs, const size_t& count, std::vector<float>& workspace) const
+    {
+        const size_t width = *std::max_element(_sizes.begin() + 1, _sizes.end());
+        if (workspace.size() < 2 * count * width)
+            workspace.resize(2 * count * width);
+
+        const float* in = inputs;
+        float* out = workspace.data();
+        for (size_t l=0; l<_weights.size(); ++l)
+        {
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+
+            for (size_t j=0; j<size_out; ++j)
+            {
+                const auto* w = _weights[l].data() + j * size_in;
+                for (size_t b=0; b<count; ++b)
+                    out[b * size_out + j] = _biases[l][j] + storage::dot(in + b * size_in, w, size_in);
+            }
+
+            in = out;
+            out = (out == workspace.data()) ? workspace.data() + count * width : workspace.data();
+        }
+        return in;
+    }
+
+    // Adds the gradient of the summed squared error over count rows of inputs and targets to the float
+    // gradients and returns that error. Gradients accumulate across calls until step
+    float accumulate(const float* inputs, const float* targets, const size_t& count, TrainWorkspace& workspace)
+    {
+        const size_t num_layers = _weights.size();
+        workspace.activations.resize(num_layers + 1);
+        workspace.activations[0].assign(inputs, inputs + count * _sizes[0]);
+
+        for (size_t l=0; l<num_layers; ++l)
+        {
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+            const float* in = workspace.activations[l].data();
+            auto& out = workspace.activations[l+1];
+            out.resize(count * size_out);
+
+            for (size_t j=0; j<size_out; ++j)
+            {
+                const auto* w = _weights[l].data() + j * size_in;
+                for (size_t b=0; b<count; ++b)
+                    out[b * size_out + j] = _biases[l][j] + storage::dot(in + b * size_in, w, size_in);
+            }
+        }
+
+        float loss = 0.0f;
+        const size_t size_last = _sizes.back();
+        const auto& y = workspace.activations[num_layers];
+        workspace.delta.resize(count * size_last);
+        for (size_t i=0; i<count * size_last; ++i)
+        {
+            const float diff = y[i] - targets[i];
+            loss += diff * diff;
+            workspace.delta[i] = 2.0f * diff;
+        }
+
+        for (size_t l=num_layers; l-->0;)
+        {
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+            const float* in = workspace.activations[l].data();
+            const float* delta = workspace.delta.data();
+
+            // The input layer's error term is never used
+            if (l > 0)
+                workspace.delta_in.assign(count * size_in, 0.0f);
+
+            for (size_t j=0; j<size_out; ++j)
+            {
+                const auto* w = _weights[l].data() + j * size_in;
+                float* dw = _weight_grads[l].data() + j * size_in;
+                for (size_t b=0; b<count; ++b)
+                {
+                    const float d = delta[b * size_out + j];
+                    _bias_grads[l][j] += d;
+                    simd_axpy(d, in + b * size_in, dw, size_in);
+                    if (l > 0)
+                        storage::axpy(d, w, workspace.delta_in.data() + b * size_in, size_in);
+                }
+            }
+
+            if (l > 0)
+                std::swap(workspace.delta, workspace.delta_in);
+        }
+        return loss;
+    }
+
+    // Plain SGD on the master copy, then re-encodes the working weights and zeroes the gradients
+    void step(const float& learning_rate)
+    {
+        for (size_t l=0; l<_weights.size(); ++l)
+        {
+            simd_axpy(-learning_rate, _weight_grads[l].data(), _master[l].data(), _master[l].size());
+            simd_axpy(-learning_rate, _bias_grads[l].data(), _biases[l].data(), _biases[l].size());
+            encode_layer(l);
+            std::fill(_weight_grads[l].begin(), _weight_grads[l].end(), 0.0f);
+            std::fill(_bias_grads[l].begin(), _bias_grads[l].end(), 0.0f);
+        }
+    }
+
+    float train_batch(const float* inputs, const float* targets, const size_t& count, const float& learning_rate,
+                      TrainWorkspace& workspace)
+    {
+        const float loss = accumulate(inputs, targets, count, workspace);
+        step(learning_rate);
+        return loss;
+    }
+
+    // Writes the master weights and biases back into model, which must have the same sizes
+    template <class T>
+    void store(MLP<T>& model) const
+    {
+        assert(model.get_sizes() == _sizes);
+        const auto params = model.get_parameters();
+        size_t k = 0;
+        for (size_t l=0; l<_weights.size(); ++l)
+        {
+            const size_t size_in = _sizes[l];
+            for (size_t j=0; j<_sizes[l+1]; ++j)
+            {
+                params[k++]->get_data() = static_cast<T>(_biases[l][j]);
+                for (size_t i=0; i<size_in; ++i)
+                    params[k++]->get_data() = static_cast<T>(_master[l][j * size_in + i]);
+            }
+        }
+        assert(k == params.size());
+    }
+};
+
+// Symmetric scale mapping [-max|x|, max|x|] onto [-127, 127]
+inline float int8_scale(const float* x, const size_t& n)
+{
+    float m = 0.0f;
+    for (size_t i=0; i<n; ++i)
+        m = std::max(m, std::fabs(x[i]));
+    return m > 0.0f ? m / 127.0f : 1.0f;
+}
+
+inline void quantize_int8(const float* x, int8_t* q, const float& scale, const size_t& n)
+{
+    const float inv = 1.0f / scale;
+    for (size_t i=0; i<n; ++i)
+        q[i] = static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, std::nearbyint(x[i] * inv))));
+}
+
+// Int8 weights with one symmetric scale per layer. Each input row is quantised on the fly with its own scale,
+// the dot products accumulate exactly in int32 and are rescaled to float before the bias is added
+class QuantizedMLP
+{
+private:
+    std::vector<size_t> _sizes;
+    std::vector<std::vector<int8_t>> _weights;
+    std::vector<float> _scales;
+    std::vector<std::vector<float>> _biases;
+
+public:
+    struct Workspace
+    {
+        std::vector<float> values;
+        std::vector<int8_t> quantized;
+        std::vector<float> scales;
+    };
+
+    using value_type = float;
+    using workspace_type = Workspace;
+
+    template <class T>
+    QuantizedMLP(const PackedMLP<T>& packed): _sizes{packed.get_sizes()}
+    {
+        for (size_t l=0; l+1<_sizes.size(); ++l)
+        {
+            const auto& b = packed.get_bias(l);
+            const std::vector<float> w(packed.get_weights(l).begin(), packed.get_weights(l).end());
+            _scales.push_back(int8_scale(w.data(), w.size()));
+            _weights.push_back(std::vector<int8_t>(w.size()));
+            quantize_int8(w.data(), _weights[l].data(), _scales[l], w.size());
+            _biases.push_back(std::vector<float>(b.begin(), b.end()));
+        }
+    }
+
+    const std::vector<size_t>& get_sizes() const { return _sizes; }
+    float get_scale(const size_t& layer) const { return _scales[layer]; }
+
+    size_t num_bytes() const
+    {
+        size_t rval = _scales.size() * sizeof(float);
+        for (size_t l=0; l<_weights.size(); ++l)
+            rval += _weights[l].size() * sizeof(int8_t) + _biases[l].size() * sizeof(float);
+        return rval;
+    }
+
+    // As PackedMLP::forward
+    const float* forward(const float* inputs, const size_t& count, Workspace& workspace) const
+    {
+        const size_t width = *std::max_element(_sizes.begin() + 1, _sizes.end());
+        const size_t widest = *std::max_element(_sizes.begin(), _sizes.end());
+        if (workspace.values.size() < 2 * count * width)
+            workspace.values.resize(2 * count * width);
+        if (workspace.quantized.size() < count * widest)
+            workspace.quantized.resize(count * widest);
+        if (workspace.scales.size() < count)
+            workspace.scales.resize(count);
+
+        const float* in = inputs;
+        float* out = workspace.values.data();
+        for (size_t l=0; l<_weights.size(); ++l)
+        {
+            const size_t size_in = _sizes[l];
+            const size_t size_out = _sizes[l+1];
+
+            int8_t* q = workspace.quantized.data();
+            for (size_t b=0; b<count; ++b)
+            {
+                workspace.scales[b] = int8_scale(in + b * size_in, size_in);
+                quantize_int8(in + b * size_in, q + b * size_in, workspace.scales[b], size_in);
+            }
+
+            for (size_t j=0; j<size_out; ++j)
+            {
+                const int8_t* w = _weights[l].data() + j * size_in;
+                for (size_t b=0; b<count; ++b)
+                {
+                    const int32_t acc = simd_dot_i8(q + b * size_in, w, size_in);
+                    out[b * size_out + j] = _biases[l][j] + workspace.scales[b] * _scales[l] * static_cast<float>(acc);
+                }
+            }
+
+            in = out;
+            out = (out == workspace.values.data()) ? workspace.values.data() + count * width : workspace.values.data();
+        }
+        return in;
+    }
+};
+
+#endif
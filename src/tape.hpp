@@ -0,0 +1,429 @@
+#ifndef TAPE_HPP
+#define TAPE_HPP
+
+#include<iostream>
+#include<cmath>
+#include<vector>
+#include<atomic>
+#include<utility>
+#include<algorithm>
+#include<assert.h>
+
+#include "value.hpp"
+
+// Forward declarations
+template<class T> class Tape;
+template<class T> class TapeValue;
+
+// Operation codes recorded on the tape
+enum class TapeOp : unsigned char
+{
+    leaf,
+    add,
+    sub,
+    mul,
+    div,
+    pow,
+    relu,
+    affine,
+    squared_error
+};
+
+// A single tape entry. Operands are indices of earlier entries on the same tape
+template <class T>
+struct TapeNode
+{
+    TapeOp op;
+    size_t lhs; // For affine and squared_error, offset of the operand list
+    size_t rhs; // For affine and squared_error, number of inputs
+    T data;
+    T grad;
+    T aux; // Exponent for pow
+};
+
+// Per-step graph context. Ops are appended in evaluation order, so the tape is already in
+// topological order and backward is a single reverse sweep with no closures or refcounting.
+// Leaves may be bound to a Value<T> parameter, whose grad is accumulated after each backward.
+// The tape runs beside the Value engine rather than under it: Value keeps its own nodes, and graph code
+// written against the shared interface, such as the Neuron, Layer and MLP overloads, records on either.
+// The training paths, DataParallelTrainer, HogwildTrainer and ExecutionPlan, all run on the tape.
+template <class T>
+class Tape
+{
+private:
+    std::vector<TapeNode<T>> _nodes;
+    std::vector<size_t> _operands;
+    std::vector<std::pair<size_t, _Value<T>*>> _bindings;
+    std::vector<std::pair<size_t, const T*>> _sources;
+
+public:
+    Tape() = default;
+    Tape(const size_t& capacity) { _nodes.reserve(capacity); }
+    ~Tape() = default;
+
+    // Pinned, as explained on ParameterBuffer, since TapeValues hold its address
+    Tape(const Tape&) = delete;
+    Tape(Tape&&) = delete;
+    Tape& operator=(const Tape&) = delete;
+    Tape& operator=(Tape&&) = delete;
+
+    // New leaves
+    TapeValue<T> variable(const T& data)
+    {
+        return TapeValue<T>(this, push(TapeOp::leaf, 0, 0, data));
+    }
+
+    TapeValue<T> variable(const Value<T>& param)
+    {
+        size_t index = push(TapeOp::leaf, 0, 0, param.get_data());
+        _bindings.push_back({index, param.get_ptr().get()});
+        return TapeValue<T>(this, index);
+    }
+
+    // Leaf read from external storage. It is reloaded from there when the tape is replayed
+    TapeValue<T> input(const T* source)
+    {
+        size_t index = push(TapeOp::leaf, 0, 0, *source);
+        _sources.push_back({index, source});
+        return TapeValue<T>(this, index);
+    }
+
+    size_t push(const TapeOp& op, const size_t& lhs, const size_t& rhs, const T& data, const T& aux=static_cast<T>(0))
+    {
+        _nodes.push_back({op, lhs, rhs, data, static_cast<T>(0), aux});
+        return _nodes.size() - 1;
+    }
+
+    // Fused bias + sum_i inputs[i]*weights[i]. Operands are stored as n inputs, n weights, then the bias
+    size_t push_affine(const std::vector<TapeValue<T>>& inputs, const std::vector<TapeValue<T>>& weights, const TapeValue<T>& bias)
+    {
+        assert(inputs.size() == weights.size());
+        const size_t n = inputs.size();
+        const size_t offset = _operands.size();
+
+        T data = _nodes[bias.get_index()].data;
+        for (size_t i=0; i<n; ++i)
+        {
+            data += _nodes[inputs[i].get_index()].data * _nodes[weights[i].get_index()].data;
+            _operands.push_back(inputs[i].get_index());
+        }
+        for (size_t i=0; i<n; ++i)
+            _operands.push_back(weights[i].get_index());
+        _operands.push_back(bias.get_index());
+
+        return push(TapeOp::affine, offset, n, data);
+    }
+
+    // Fused sum_i (outputs[i] - targets[i])^2. Operands are stored as n outputs then n targets
+    size_t push_squared_error(const std::vector<TapeValue<T>>& outputs, const std::vector<TapeValue<T>>& targets)
+    {
+        assert(outputs.size() == targets.size());
+        const size_t n = outputs.size();
+        const size_t offset = _operands.size();
+
+        T data = static_cast<T>(0);
+        for (size_t i=0; i<n; ++i)
+        {
+            const T diff = _nodes[outputs[i].get_index()].data - _nodes[targets[i].get_index()].data;
+            data += diff * diff;
+            _operands.push_back(outputs[i].get_index());
+        }
+        for (size_t i=0; i<n; ++i)
+            _operands.push_back(targets[i].get_index());
+
+        return push(TapeOp::squared_error, offset, n, data);
+    }
+
+    // Getters
+    size_t size() const { return _nodes.size(); }
+    const TapeNode<T>& operator[](const size_t& index) const { return _nodes[index]; }
+    TapeNode<T>& operator[](const size_t& index) { return _nodes[index]; }
+    const std::vector<std::pair<size_t, _Value<T>*>>& get_bindings() const { return _bindings; }
+
+    // Drops all entries but keeps the allocation for the next step
+    void clear()
+    {
+        _nodes.clear();
+        _operands.clear();
+        _bindings.clear();
+        _sources.clear();
+    }
+
+    // Re-evaluates every entry in order, after reloading input leaves from their sources and bound
+    // leaves from their parameters. Constant leaves keep their recorded values
+    void replay()
+    {
+        for (auto& b : _bindings)
+            _nodes[b.first].data = b.second->get_data();
+        evaluate();
+    }
+
+    // As replay(), but bound leaf k is read from params[k] instead of its parameter. For a tape recorded
+    // from MLP::loss that is slot k of the model's buffer, see DataParallelTrainer
+    void replay(const std::atomic<T>* params)
+    {
+        for (size_t k=0; k<_bindings.size(); ++k)
+            _nodes[_bindings[k].first].data = params[k].load(std::memory_order_relaxed);
+        evaluate();
+    }
+
+    // Re-evaluates every entry in order after reloading only the input leaves
+    void evaluate()
+    {
+        for (auto& s : _sources)
+            _nodes[s.first].data = *s.second;
+
+        for (auto& n : _nodes)
+        {
+            switch (n.op)
+            {
+            case TapeOp::leaf:
+                break;
+            case TapeOp::add:
+                n.data = _nodes[n.lhs].data + _nodes[n.rhs].data;
+                break;
+            case TapeOp::sub:
+                n.data = _nodes[n.lhs].data - _nodes[n.rhs].data;
+                break;
+            case TapeOp::mul:
+                n.data = _nodes[n.lhs].data * _nodes[n.rhs].data;
+                break;
+            case TapeOp::div:
+                n.data = _nodes[n.lhs].data / _nodes[n.rhs].data;
+                break;
+            case TapeOp::pow:
+                n.data = std::pow(_nodes[n.lhs].data, n.aux);
+                break;
+            case TapeOp::relu:
+                n.data = std::max(static_cast<T>(0), _nodes[n.lhs].data);
+                break;
+            case TapeOp::affine:
+            {
+                const size_t* ops = _operands.data() + n.lhs;
+                T data = _nodes[ops[2*n.rhs]].data;
+                for (size_t j=0; j<n.rhs; ++j)
+                    data += _nodes[ops[j]].data * _nodes[ops[n.rhs+j]].data;
+                n.data = data;
+                break;
+            }
+            case TapeOp::squared_error:
+            {
+                const size_t* ops = _operands.data() + n.lhs;
+                T data = static_cast<T>(0);
+                for (size_t j=0; j<n.rhs; ++j)
+                {
+                    const T diff = _nodes[ops[j]].data - _nodes[ops[n.rhs+j]].data;
+                    data += diff * diff;
+                }
+                n.data = data;
+                break;
+            }
+            }
+        }
+    }
+
+    void zero_grad()
+    {
+        for (auto& n : _nodes)
+            n.grad = static_cast<T>(0);
+    }
+
+    // Reverse sweep from root, leaving bound parameters untouched. Entries after root cannot contribute
+    // to it and are left alone
+    void sweep(const size_t& root)
+    {
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::tape_sweep);
+        assert(root < _nodes.size());
+
+        for (size_t i=0; i<=root; ++i)
+            _nodes[i].grad = static_cast<T>(0);
+
+        // Set dx/dx=1
+        _nodes[root].grad = static_cast<T>(1);
+        for (size_t i=root+1; i-->0;)
+        {
+            const TapeNode<T>& n = _nodes[i];
+            switch (n.op)
+            {
+            case TapeOp::leaf:
+                break;
+            case TapeOp::add:
+                _nodes[n.lhs].grad += n.grad;
+                _nodes[n.rhs].grad += n.grad;
+                break;
+            case TapeOp::sub:
+                _nodes[n.lhs].grad += n.grad;
+                _nodes[n.rhs].grad -= n.grad;
+                break;
+            case TapeOp::mul:
+                _nodes[n.lhs].grad += _nodes[n.rhs].data * n.grad;
+                _nodes[n.rhs].grad += _nodes[n.lhs].data * n.grad;
+                break;
+            case TapeOp::div:
+                _nodes[n.lhs].grad += n.grad / _nodes[n.rhs].data;
+                _nodes[n.rhs].grad -= n.data / _nodes[n.rhs].data * n.grad;
+                break;
+            case TapeOp::pow:
+                _nodes[n.lhs].grad += (n.aux * std::pow(_nodes[n.lhs].data, n.aux - static_cast<T>(1))) * n.grad;
+                break;
+            case TapeOp::relu:
+                if (_nodes[n.lhs].data > static_cast<T>(0))
+                    _nodes[n.lhs].grad += n.grad;
+                break;
+            case TapeOp::affine:
+            {
+                const size_t* ops = _operands.data() + n.lhs;
+                for (size_t j=0; j<n.rhs; ++j)
+                {
+                    _nodes[ops[j]].grad += _nodes[ops[n.rhs+j]].data * n.grad;
+                    _nodes[ops[n.rhs+j]].grad += _nodes[ops[j]].data * n.grad;
+                }
+                _nodes[ops[2*n.rhs]].grad += n.grad;
+                break;
+            }
+            case TapeOp::squared_error:
+            {
+                const size_t* ops = _operands.data() + n.lhs;
+                for (size_t j=0; j<n.rhs; ++j)
+                {
+                    const T g = static_cast<T>(2) * (_nodes[ops[j]].data - _nodes[ops[n.rhs+j]].data) * n.grad;
+                    _nodes[ops[j]].grad += g;
+                    _nodes[ops[n.rhs+j]].grad -= g;
+                }
+                break;
+            }
+            }
+        }
+    }
+
+    // Reverse sweep from root, then accumulate leaf grads into the bound parameters
+    void backward(const size_t& root)
+    {
+        sweep(root);
+        for (auto& b : _bindings)
+            if (b.first <= root)
+                b.second->get_grad() += _nodes[b.first].grad;
+    }
+};
+
+// Handle to a tape entry. Mirrors the Value<T> interface so graph-building code can run on either engine.
+// Friends are non-templates so that several precisions can share a translation unit
+template <class T>
+class TapeValue
+{
+    friend std::ostream& operator<<(std::ostream& os, const TapeValue<T>& val)
+    {
+        os << "Value(" << val.get_data() << ", " << val.get_grad() << ")";
+        return os;
+    }
+
+    friend TapeValue<T> pow(const TapeValue<T>& val, const T& exp)
+    {
+        return val.make(TapeOp::pow, val._index, 0, std::pow(val.get_data(), exp), exp);
+    }
+
+    friend TapeValue<T> affine(const std::vector<TapeValue<T>>& inputs, const std::vector<TapeValue<T>>& weights, const TapeValue<T>& bias)
+    {
+        return TapeValue<T>(bias._tape, bias._tape->push_affine(inputs, weights, bias));
+    }
+
+    // Summed squared error of outputs against target, whose values are read from storage as Tape::input
+    // reads them, so a replay picks up a new target
+    friend TapeValue<T> squared_error(const std::vector<TapeValue<T>>& outputs, const T* target)
+    {
+        assert(!outputs.empty());
+        Tape<T>* tape = outputs.front()._tape;
+        std::vector<TapeValue<T>> targets;
+        targets.reserve(outputs.size());
+        for (size_t i=0; i<outputs.size(); ++i)
+            targets.push_back(tape->input(target + i));
+        return TapeValue<T>(tape, tape->push_squared_error(outputs, targets));
+    }
+
+    friend TapeValue<T> operator+(const T& num, const TapeValue<T>& val) {return val + num;}
+
+    friend TapeValue<T> operator-(const T& num, const TapeValue<T>& val) {return val.constant(num) - val;}
+
+    friend TapeValue<T> operator*(const T& num, const TapeValue<T>& val) {return val * num;}
+
+    friend TapeValue<T> operator/(const T& num, const TapeValue<T>& val) {return val.constant(num) / val;}
+
+private:
+    Tape<T>* _tape = nullptr;
+    size_t _index = 0;
+
+    TapeValue<T> make(const TapeOp& op, const size_t& lhs, const size_t& rhs, const T& data, const T& aux=static_cast<T>(0)) const
+    {
+        return TapeValue<T>(_tape, _tape->push(op, lhs, rhs, data, aux));
+    }
+
+    TapeValue<T> constant(const T& data) const { return _tape->variable(data); }
+
+public:
+    TapeValue() = default;
+    TapeValue(Tape<T>* tape, const size_t& index): _tape{tape}, _index{index} {}
+
+    // Transparency to the tape entry
+    const T& get_data() const { return (*_tape)[_index].data; }
+    const T& get_grad() const { return (*_tape)[_index].grad; }
+    T& get_data() { return (*_tape)[_index].data; }
+    T& get_grad() { return (*_tape)[_index].grad; }
+    void backward() const { _tape->backward(_index); }
+
+    // Tape accessors
+    Tape<T>* get_tape() const { return _tape; }
+    size_t get_index() const { return _index; }
+
+    // Relu
+    TapeValue<T> relu() const
+    {
+        return make(TapeOp::relu, _index, 0, std::max(static_cast<T>(0), get_data()));
+    }
+
+    // Arithmetic operators
+    TapeValue<T> operator+(const TapeValue<T>& other) const
+    {
+        assert(_tape == other._tape);
+        return make(TapeOp::add, _index, other._index, get_data() + other.get_data());
+    }
+
+    TapeValue<T> operator+(const T& other) const { return operator+(constant(other)); }
+
+    TapeValue<T> operator-(const TapeValue<T>& other) const
+    {
+        assert(_tape == other._tape);
+        return make(TapeOp::sub, _index, other._index, get_data() - other.get_data());
+    }
+
+    TapeValue<T> operator-(const T& other) const { return operator-(constant(other)); }
+
+    TapeValue<T> operator*(const TapeValue<T>& other) const
+    {
+        assert(_tape == other._tape);
+        return make(TapeOp::mul, _index, other._index, get_data() * other.get_data());
+    }
+
+    TapeValue<T> operator*(const T& other) const { return operator*(constant(other)); }
+
+    TapeValue<T> operator/(const TapeValue<T>& other) const
+    {
+        assert(_tape == other._tape);
+        return make(TapeOp::div, _index, other._index, get_data() / other.get_data());
+    }
+
+    TapeValue<T> operator/(const T& other) const { return operator/(constant(other)); }
+
+    TapeValue<T> operator-() const
+    {
+        return operator*(static_cast<T>(-1));
+    }
+
+    // Comparison operators
+    bool operator==(const TapeValue<T>& other) const { return get_data() == other.get_data(); }
+    bool operator<(const TapeValue<T>& other) const { return get_data() < other.get_data(); }
+    bool operator>(const TapeValue<T>& other) const { return get_data() > other.get_data(); }
+    bool operator<=(const TapeValue<T>& other) const { return get_data() <= other.get_data(); }
+    bool operator>=(const TapeValue<T>& other) const { return get_data() >= other.get_data(); }
+};
+
+#endif
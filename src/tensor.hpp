@@ -0,0 +1,425 @@
+#ifndef TENSOR_HPP
+#define TENSOR_HPP
+
+#include<iostream>
+#include<cmath>
+#include<vector>
+#include<utility>
+#include<functional>
+#include<memory>
+#include<atomic>
+#include<numeric>
+#include<algorithm>
+#include<assert.h>
+
+#include "value.hpp"
+#include "kernels.hpp"
+
+// Forward declarations
+template<class T> class _Tensor;
+template<class T> class Tensor;
+
+// Number of elements for a shape. An empty shape is a scalar
+inline size_t shape_size(const std::vector<size_t>& shape)
+{
+    return std::accumulate(shape.begin(), shape.end(), static_cast<size_t>(1), std::multiplies<size_t>());
+}
+
+// Stacks equally sized rows into a [rows, cols] tensor
+template <class T>
+Tensor<T> stack_rows(const std::vector<std::vector<T>>& rows)
+{
+    assert(!rows.empty());
+
+    const size_t cols = rows[0].size();
+    std::vector<T> data;
+    data.reserve(rows.size() * cols);
+    for (auto& r : rows)
+    {
+        assert(r.size() == cols);
+        data.insert(data.end(), r.begin(), r.end());
+    }
+    return Tensor<T>({rows.size(), cols}, std::move(data));
+}
+
+// Hidden tensor node, the vector-valued counterpart of _Value. Data and grad are contiguous row-major buffers
+template <class T>
+class _Tensor
+{
+    template <class C> friend class Tensor;
+
+private:
+    std::vector<size_t> _shape;
+    std::vector<T> _data;
+    std::vector<T> _grad;
+    std::vector<std::shared_ptr<_Tensor<T>>> _parents;
+    std::function<void()> _backward = do_nothing;
+    size_t _mark{0};
+    std::vector<_Tensor<T>*> _topo;
+
+    // As _Value::next_epoch
+    static size_t next_epoch()
+    {
+        static std::atomic<size_t> epoch{0};
+        return epoch.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+public:
+    _Tensor(const std::vector<size_t>& shape, std::vector<T>&& data, const std::vector<std::shared_ptr<_Tensor<T>>>& parents):
+    _shape{shape}, _data{std::move(data)}, _grad(_data.size(), static_cast<T>(0)), _parents{parents}
+    {
+        assert(_data.size() == shape_size(_shape));
+    }
+
+    _Tensor(const std::vector<size_t>& shape, std::vector<T>&& data):
+    _shape{shape}, _data{std::move(data)}, _grad(_data.size(), static_cast<T>(0))
+    {
+        assert(_data.size() == shape_size(_shape));
+    }
+    ~_Tensor() = default;
+
+    // Copy and move constructors
+    _Tensor(const _Tensor&) = delete;
+    _Tensor(_Tensor&&) = delete;
+
+    // Copy and move assignment operators
+    _Tensor<T>& operator=(const _Tensor<T>& other) = delete;
+    _Tensor<T>& operator=(_Tensor<T>&& other) = delete;
+
+    // Getters
+    const std::vector<size_t>& get_shape() const { return _shape; }
+    size_t size() const { return _data.size(); }
+    const std::vector<T>& get_data() const { return _data; }
+    const std::vector<T>& get_grad() const { return _grad; }
+    std::vector<T>& get_data() { return _data; }
+    std::vector<T>& get_grad() { return _grad; }
+    const std::vector<std::shared_ptr<_Tensor<T>>>& get_parent_ptrs() const { return _parents; }
+
+    // Setters
+    void zero_grad() { std::fill(_grad.begin(), _grad.end(), static_cast<T>(0)); }
+    void zero_grad_all()
+    {
+        for (auto n : build_topo())
+            n->zero_grad();
+    }
+    void set_backward(const std::function<void()>& func) { _backward = func; }
+
+    // Topological sort, same scheme as _Value::build_topo
+    const std::vector<_Tensor<T>*>& build_topo()
+    {
+        if (!_topo.empty())
+            return _topo;
+
+        const size_t epoch = next_epoch();
+        static thread_local std::vector<std::pair<_Tensor<T>*, size_t>> stack;
+        stack.clear();
+
+        _mark = epoch;
+        stack.push_back({this, 0});
+        while (!stack.empty())
+        {
+            auto& top = stack.back();
+            _Tensor<T>* node = top.first;
+            if (top.second < node->_parents.size())
+            {
+                _Tensor<T>* par_ptr = node->_parents[top.second++].get();
+                if (par_ptr->_mark != epoch)
+                {
+                    par_ptr->_mark = epoch;
+                    stack.push_back({par_ptr, 0});
+                }
+            }
+            else
+            {
+                _topo.push_back(node);
+                stack.pop_back();
+            }
+        }
+        return _topo;
+    }
+
+    // Backpropagation, seeds every element of this tensor with 1
+    void backward()
+    {
+        const auto& order = build_topo();
+
+        std::fill(_grad.begin(), _grad.end(), static_cast<T>(1));
+        for (auto n=order.rbegin(); n!=order.rend(); ++n)
+            (*n)->_backward();
+    }
+
+    void descend_grad(const T& learning_rate)
+    {
+        for (size_t i=0; i<_data.size(); ++i)
+            _data[i] -= learning_rate * _grad[i];
+    }
+};
+
+// Central Tensor class. Each op is a single graph node regardless of the number of elements
+template <class T>
+class Tensor
+{
+    friend std::ostream& operator<<(std::ostream& os, const Tensor<T>& val)
+    {
+        os << "Tensor(shape=(";
+        for (size_t i=0; i<val.get_shape().size(); ++i)
+            os << (i ? ", " : "") << val.get_shape()[i];
+        os << "), data=(";
+        for (size_t i=0; i<val.size(); ++i)
+            os << (i ? ", " : "") << val.get_data()[i];
+        os << "))";
+        return os;
+    }
+
+    // Elementwise power
+    friend Tensor<T> pow(const Tensor<T>& val, const T& exp)
+    {
+        std::vector<T> data(val.size());
+        for (size_t i=0; i<data.size(); ++i)
+            data[i] = std::pow(val.get_data()[i], exp);
+        auto out = Tensor<T>(val.get_shape(), std::move(data), {val.get_ptr(),});
+
+        _Tensor<T>* val_ptr = val.get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            for (size_t i=0; i<out_ptr->size(); ++i)
+                val_ptr->get_grad()[i] += (exp * std::pow(val_ptr->get_data()[i], exp - static_cast<T>(1))) * out_ptr->get_grad()[i];
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    // Matrix product. A 1-D left operand is treated as a single row, a 1-D right operand as a single column
+    friend Tensor<T> matmul(const Tensor<T>& lhs, const Tensor<T>& rhs)
+    {
+        const auto& ls = lhs.get_shape();
+        const auto& rs = rhs.get_shape();
+        assert(ls.size() == 1 || ls.size() == 2);
+        assert(rs.size() == 1 || rs.size() == 2);
+
+        const size_t m = ls.size() == 2 ? ls[0] : 1;
+        const size_t k = ls.back();
+        const size_t n = rs.size() == 2 ? rs[1] : 1;
+        assert(rs[0] == k);
+
+        std::vector<size_t> shape;
+        if (ls.size() == 2)
+            shape.push_back(m);
+        if (rs.size() == 2)
+            shape.push_back(n);
+
+        std::vector<T> data(m * n, static_cast<T>(0));
+        const T* a = lhs.get_data().data();
+        const T* b = rhs.get_data().data();
+        for (size_t i=0; i<m; ++i)
+            for (size_t p=0; p<k; ++p)
+                simd_axpy(a[i*k + p], b + p*n, data.data() + i*n, n);
+        auto out = Tensor<T>(shape, std::move(data), {lhs.get_ptr(), rhs.get_ptr()});
+
+        _Tensor<T>* lhs_ptr = lhs.get_ptr().get();
+        _Tensor<T>* rhs_ptr = rhs.get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        // dA += dC B^T, dB += A^T dC
+        auto _back = [=]()
+        {
+            const T* a = lhs_ptr->get_data().data();
+            const T* b = rhs_ptr->get_data().data();
+            const T* dc = out_ptr->get_grad().data();
+            T* da = lhs_ptr->get_grad().data();
+            T* db = rhs_ptr->get_grad().data();
+            for (size_t i=0; i<m; ++i)
+                for (size_t p=0; p<k; ++p)
+                {
+                    da[i*k + p] += simd_dot(dc + i*n, b + p*n, n);
+                    simd_axpy(a[i*k + p], dc + i*n, db + p*n, n);
+                }
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    // Sum of all elements, a scalar tensor
+    friend Tensor<T> sum(const Tensor<T>& val)
+    {
+        const auto& d = val.get_data();
+        auto out = Tensor<T>({}, {std::accumulate(d.begin(), d.end(), static_cast<T>(0))}, {val.get_ptr(),});
+
+        _Tensor<T>* val_ptr = val.get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            const T g = out_ptr->get_grad()[0];
+            for (auto& vg : val_ptr->get_grad())
+                vg += g;
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+
+private:
+    std::shared_ptr<_Tensor<T>> _ptr = nullptr;
+
+    Tensor(const std::vector<size_t>& shape, std::vector<T>&& data, const std::vector<std::shared_ptr<_Tensor<T>>>& parents)
+    {
+        if (GradMode::is_enabled())
+            _ptr = std::make_shared<_Tensor<T>>(shape, std::move(data), parents);
+        else
+            _ptr = std::make_shared<_Tensor<T>>(shape, std::move(data));
+    }
+
+    // Right operand of an elementwise op must be the same size, a scalar or a row matching the last dimension.
+    // Elements of the right operand are then found at i % rhs.size()
+    static bool broadcastable(const Tensor<T>& lhs, const Tensor<T>& rhs)
+    {
+        return rhs.size() == lhs.size() || rhs.size() == 1 ||
+            (!lhs.get_shape().empty() && rhs.get_shape().size() == 1 && rhs.size() == lhs.get_shape().back());
+    }
+
+public:
+    // Constructors and destructors
+    Tensor(): Tensor(std::vector<size_t>{}, std::vector<T>{static_cast<T>(0)}) {}
+    Tensor(const std::vector<size_t>& shape, const T& fill=static_cast<T>(0))
+    {
+        _ptr = std::make_shared<_Tensor<T>>(shape, std::vector<T>(shape_size(shape), fill));
+    }
+    Tensor(const std::vector<size_t>& shape, std::vector<T> data)
+    {
+        _ptr = std::make_shared<_Tensor<T>>(shape, std::move(data));
+    }
+    ~Tensor() { _ptr = nullptr; };
+
+    // Copy and move constructors
+    Tensor(const Tensor& other) { _ptr = other._ptr; }
+    Tensor(Tensor&& other) { _ptr = other._ptr; other._ptr = nullptr; }
+
+    // Copy and move assignment operators
+    Tensor<T>& operator=(const Tensor<T>& other) { if (&other!=this) _ptr = other._ptr; return *this; }
+    Tensor<T>& operator=(Tensor<T>&& other) { _ptr = other._ptr; other._ptr = nullptr; return *this; }
+
+    // Transparency to the _Tensor class
+    const std::vector<size_t>& get_shape() const { return _ptr->get_shape(); }
+    size_t size() const { return _ptr->size(); }
+    const std::vector<T>& get_data() const { return _ptr->get_data(); }
+    const std::vector<T>& get_grad() const { return _ptr->get_grad(); }
+    std::vector<T>& get_data() { return _ptr->get_data(); }
+    std::vector<T>& get_grad() { return _ptr->get_grad(); }
+    void zero_grad() const { _ptr->zero_grad(); }
+    void zero_grad_all() const { _ptr->zero_grad_all(); }
+    void set_backward(std::function<void()> func) const { if (GradMode::is_enabled()) _ptr->set_backward(func); }
+    void backward() const { _ptr->backward(); }
+    void descend_grad(const T& learning_rate) const { _ptr->descend_grad(learning_rate); }
+    const std::vector<_Tensor<T>*>& build_topo() const { return _ptr->build_topo(); }
+
+    // ptr accessor
+    std::shared_ptr<_Tensor<T>> get_ptr() const { return _ptr; }
+
+    // Relu
+    Tensor<T> relu() const
+    {
+        std::vector<T> data(size());
+        simd_relu(get_data().data(), data.data(), data.size());
+        auto out = Tensor<T>(get_shape(), std::move(data), {get_ptr(),});
+
+        _Tensor<T>* this_ptr = get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            simd_relu_backward(this_ptr->get_data().data(), out_ptr->get_grad().data(), this_ptr->get_grad().data(), out_ptr->size());
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    // Arithmetic operators, with the right operand broadcast over the left
+    Tensor<T> operator+(const Tensor<T>& other) const
+    {
+        assert(broadcastable(*this, other));
+
+        const size_t n = other.size();
+        std::vector<T> data(size());
+        for (size_t i=0; i<data.size(); ++i)
+            data[i] = get_data()[i] + other.get_data()[i % n];
+        auto out = Tensor<T>(get_shape(), std::move(data), {get_ptr(), other.get_ptr()});
+
+        _Tensor<T>* this_ptr = get_ptr().get();
+        _Tensor<T>* other_ptr = other.get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            for (size_t i=0; i<out_ptr->size(); ++i)
+            {
+                this_ptr->get_grad()[i] += out_ptr->get_grad()[i];
+                other_ptr->get_grad()[i % n] += out_ptr->get_grad()[i];
+            }
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    Tensor<T> operator-(const Tensor<T>& other) const
+    {
+        assert(broadcastable(*this, other));
+
+        const size_t n = other.size();
+        std::vector<T> data(size());
+        for (size_t i=0; i<data.size(); ++i)
+            data[i] = get_data()[i] - other.get_data()[i % n];
+        auto out = Tensor<T>(get_shape(), std::move(data), {get_ptr(), other.get_ptr()});
+
+        _Tensor<T>* this_ptr = get_ptr().get();
+        _Tensor<T>* other_ptr = other.get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            for (size_t i=0; i<out_ptr->size(); ++i)
+            {
+                this_ptr->get_grad()[i] += out_ptr->get_grad()[i];
+                other_ptr->get_grad()[i % n] -= out_ptr->get_grad()[i];
+            }
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    Tensor<T> operator*(const Tensor<T>& other) const
+    {
+        assert(broadcastable(*this, other));
+
+        const size_t n = other.size();
+        std::vector<T> data(size());
+        for (size_t i=0; i<data.size(); ++i)
+            data[i] = get_data()[i] * other.get_data()[i % n];
+        auto out = Tensor<T>(get_shape(), std::move(data), {get_ptr(), other.get_ptr()});
+
+        _Tensor<T>* this_ptr = get_ptr().get();
+        _Tensor<T>* other_ptr = other.get_ptr().get();
+        _Tensor<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            for (size_t i=0; i<out_ptr->size(); ++i)
+            {
+                this_ptr->get_grad()[i] += other_ptr->get_data()[i % n] * out_ptr->get_grad()[i];
+                other_ptr->get_grad()[i % n] += this_ptr->get_data()[i] * out_ptr->get_grad()[i];
+            }
+        };
+        out.set_backward(_back);
+
+        return out;
+    }
+};
+
+#endif
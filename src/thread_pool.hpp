@@ -0,0 +1,109 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include<vector>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<functional>
+#include<algorithm>
+
+// Fixed-size pool for fork-join loops. The calling thread takes part in each loop, so a pool of
+// size n owns n-1 threads
+class ThreadPool
+{
+private:
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    const std::function<void(size_t)>* _func = nullptr;
+    size_t _count = 0;
+    std::atomic<size_t> _next{0};
+    size_t _generation = 0;
+    size_t _busy = 0;
+    bool _stop = false;
+
+    void run_tasks()
+    {
+        for (size_t i; (i = _next.fetch_add(1)) < _count;)
+            (*_func)(i);
+    }
+
+    void worker_loop()
+    {
+        size_t seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _start.wait(lock, [&](){ return _stop || _generation != seen; });
+                if (_stop)
+                    return;
+                seen = _generation;
+            }
+
+            run_tasks();
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (--_busy == 0)
+                _done.notify_one();
+        }
+    }
+
+public:
+    ThreadPool(const size_t& num_threads=default_size())
+    {
+        for (size_t i=1; i<num_threads; ++i)
+            _threads.emplace_back(&ThreadPool::worker_loop, this);
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _start.notify_all();
+        for (auto& t : _threads)
+            t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    static size_t default_size() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+    size_t size() const { return _threads.size() + 1; }
+
+    // Runs func(i) for every i in [0, count) and returns once all calls have finished.
+    // Which thread runs which index is unspecified
+    void parallel_for(const size_t& count, const std::function<void(size_t)>& func)
+    {
+        if (_threads.empty() || count <= 1)
+        {
+            for (size_t i=0; i<count; ++i)
+                func(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _func = &func;
+            _count = count;
+            _next = 0;
+            _busy = _threads.size();
+            ++_generation;
+        }
+        _start.notify_all();
+
+        run_tasks();
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [&](){ return _busy == 0; });
+    }
+};
+
+#endif
@@ -0,0 +1,281 @@
+#ifndef TRAINER_HPP
+#define TRAINER_HPP
+
+#include<vector>
+#include<memory>
+#include<random>
+#include<numeric>
+#include<algorithm>
+#include<atomic>
+#include<assert.h>
+
+#include "value.hpp"
+#include "tape.hpp"
+#include "module.hpp"
+#include "plan.hpp"
+#include "optimizer.hpp"
+#include "thread_pool.hpp"
+#include "data_loader.hpp"
+
+// Synchronous data-parallel SGD for an MLP. Each mini-batch is split into one contiguous shard per
+// thread. Every shard replays its own ExecutionPlan of the loss graph, reading the shared parameters
+// but never writing them, and accumulates into its own gradient buffer. The buffers are then summed in shard
+// order and a single update is applied, so a run is deterministic for a given seed and thread count.
+template <class T>
+class DataParallelTrainer
+{
+private:
+    MLP<T>& _model;
+    ThreadPool _pool;
+    std::vector<std::shared_ptr<Value<T>>> _parameters;
+    std::vector<std::unique_ptr<ExecutionPlan<T>>> _plans;
+    std::vector<std::vector<T>> _grads;
+    std::vector<T> _losses;
+    std::mt19937 _rng;
+    Optimizer<T>* _optimizer = nullptr;
+
+    // Parameters are bound to the tape in get_parameters() order, so binding k is parameter k.
+    // sample(i) gives the input and target pointers of the i-th sample of the batch
+    template <class Sample>
+    void accumulate_shard(const size_t& shard, const size_t& count, const Sample& sample)
+    {
+        ExecutionPlan<T>& plan = *_plans[shard];
+        const Tape<T>& tape = plan.get_tape();
+        std::vector<T>& grad = _grads[shard];
+        std::fill(grad.begin(), grad.end(), static_cast<T>(0));
+        _losses[shard] = static_cast<T>(0);
+
+        const size_t shards = _plans.size();
+        const size_t begin = shard * count / shards;
+        const size_t end = (shard + 1) * count / shards;
+        for (size_t i=begin; i<end; ++i)
+        {
+            const auto io = sample(i);
+            _losses[shard] += plan.sweep(io.first, io.second);
+
+            const auto& bindings = tape.get_bindings();
+            assert(bindings.size() == grad.size());
+            for (size_t k=0; k<bindings.size(); ++k)
+            {
+                assert(bindings[k].second == _parameters[k]->get_ptr().get());
+                grad[k] += tape[bindings[k].first].grad;
+            }
+        }
+    }
+
+    template <class Sample>
+    T train(const size_t& count, const T& learning_rate, const Sample& sample)
+    {
+        _pool.parallel_for(_plans.size(), [&](size_t shard)
+        {
+            accumulate_shard(shard, count, sample);
+        });
+
+        // Reduce in shard order, split over parameter ranges
+        const size_t num_params = _parameters.size();
+        const size_t chunks = _plans.size();
+        T* data = _model.get_buffer().data();
+        T* grad = _model.get_buffer().grad();
+        if (_optimizer)
+            _optimizer->begin_step();
+        _pool.parallel_for(chunks, [&](size_t chunk)
+        {
+            const size_t begin = chunk * num_params / chunks;
+            const size_t end = (chunk + 1) * num_params / chunks;
+            for (size_t k=begin; k<end; ++k)
+            {
+                T sum = static_cast<T>(0);
+                for (auto& g : _grads)
+                    sum += g[k];
+                grad[k] += sum;
+            }
+
+            if (_optimizer)
+                _optimizer->update(begin, end);
+            else
+                for (size_t k=begin; k<end; ++k)
+                    data[k] -= learning_rate * grad[k];
+            std::fill(grad + begin, grad + end, static_cast<T>(0));
+        });
+
+        T rval = static_cast<T>(0);
+        for (auto& l : _losses)
+            rval += l;
+        return rval;
+    }
+
+public:
+    DataParallelTrainer(MLP<T>& model, const size_t& num_threads=ThreadPool::default_size(), const unsigned& seed=0):
+    _model{model}, _pool{num_threads}, _parameters{model.get_parameters()}, _rng{seed}
+    {
+        for (size_t i=0; i<_pool.size(); ++i)
+        {
+            _plans.push_back(std::make_unique<ExecutionPlan<T>>(model));
+            _grads.push_back(std::vector<T>(_parameters.size(), static_cast<T>(0)));
+        }
+        _losses.resize(_pool.size());
+    }
+    DataParallelTrainer(const DataParallelTrainer&) = delete;
+    DataParallelTrainer(DataParallelTrainer&&) = delete;
+
+    size_t num_threads() const { return _pool.size(); }
+
+    // Update rule for the model's parameter buffer, applied in the parallel reduction. The learning rate
+    // passed to train_batch/train_epoch is then ignored in favour of the optimiser's. nullptr restores SGD
+    void set_optimizer(Optimizer<T>* optimizer)
+    {
+        assert(!optimizer || &optimizer->get_buffer() == &_model.get_buffer());
+        _optimizer = optimizer;
+    }
+
+    // One SGD step over the given samples. Returns the summed loss
+    T train_batch(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>& targets,
+        const size_t* indices, const size_t& count, const T& learning_rate)
+    {
+        return train(count, learning_rate, [&](size_t i)
+        {
+            return std::make_pair(inputs[indices[i]].data(), targets[indices[i]].data());
+        });
+    }
+
+    // As above for a batch from a DataLoader
+    T train_batch(const Batch<T>& batch, const T& learning_rate)
+    {
+        return train(batch.size, learning_rate, [&](size_t i)
+        {
+            return std::make_pair(batch.input(i), batch.target(i));
+        });
+    }
+
+    // As above for the samples [begin, end) in storage order
+    T train_batch(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>& targets,
+        const size_t& begin, const size_t& end, const T& learning_rate)
+    {
+        assert(begin <= end && end <= inputs.size());
+
+        return train(end - begin, learning_rate, [&](size_t i)
+        {
+            return std::make_pair(inputs[begin + i].data(), targets[begin + i].data());
+        });
+    }
+
+    // One pass over the data in mini-batches, optionally shuffled by the seeded generator.
+    // Returns the mean loss per sample
+    T train_epoch(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>& targets,
+        const size_t& batch_size, const T& learning_rate, const bool& shuffle=true)
+    {
+        assert(inputs.size() == targets.size());
+
+        std::vector<size_t> order(inputs.size());
+        std::iota(order.begin(), order.end(), static_cast<size_t>(0));
+        if (shuffle)
+            std::shuffle(order.begin(), order.end(), _rng);
+
+        T rval = static_cast<T>(0);
+        for (size_t i=0; i<order.size(); i+=batch_size)
+            rval += train_batch(inputs, targets, order.data() + i, std::min(batch_size, order.size() - i), learning_rate);
+        return rval / static_cast<T>(inputs.size());
+    }
+};
+
+// Asynchronous lock-free SGD in the Hogwild style. Parameters live in one flat buffer of atomics that
+// every worker reads and updates in place with relaxed loads and stores, so concurrent updates may
+// overwrite each other. Each worker replays its own ExecutionPlan, recorded from the model, whose
+// parameter leaves load straight from the buffer, and writes its step straight back. Intended for the
+// many-small-updates regime; results are not deterministic when run on more than one thread.
+template <class T>
+class HogwildTrainer
+{
+private:
+    MLP<T>& _model;
+    ThreadPool _pool;
+    std::vector<std::shared_ptr<Value<T>>> _parameters;
+    std::unique_ptr<std::atomic<T>[]> _buffer;
+    std::vector<std::unique_ptr<ExecutionPlan<T>>> _plans;
+    std::vector<T> _losses;
+    std::mt19937 _rng;
+
+    void load_buffer()
+    {
+        const T* data = _model.get_buffer().data();
+        for (size_t k=0; k<_parameters.size(); ++k)
+            _buffer[k].store(data[k], std::memory_order_relaxed);
+    }
+
+    void store_buffer()
+    {
+        T* data = _model.get_buffer().data();
+        for (size_t k=0; k<_parameters.size(); ++k)
+            data[k] = _buffer[k].load(std::memory_order_relaxed);
+    }
+
+    void run_worker(const size_t& worker, const std::vector<std::vector<T>>& inputs,
+        const std::vector<std::vector<T>>& targets, const std::vector<size_t>& order, const T& learning_rate)
+    {
+        ExecutionPlan<T>& plan = *_plans[worker];
+        const Tape<T>& tape = plan.get_tape();
+        _losses[worker] = static_cast<T>(0);
+
+        const size_t workers = _plans.size();
+        const size_t begin = worker * order.size() / workers;
+        const size_t end = (worker + 1) * order.size() / workers;
+        for (size_t i=begin; i<end; ++i)
+        {
+            _losses[worker] += plan.sweep(inputs[order[i]].data(), targets[order[i]].data(), _buffer.get());
+
+            // Binding k is parameter k, see DataParallelTrainer
+            const auto& bindings = tape.get_bindings();
+            for (size_t k=0; k<bindings.size(); ++k)
+            {
+                const T step = learning_rate * tape[bindings[k].first].grad;
+                _buffer[k].store(_buffer[k].load(std::memory_order_relaxed) - step, std::memory_order_relaxed);
+            }
+        }
+    }
+
+public:
+    HogwildTrainer(MLP<T>& model, const size_t& num_threads=ThreadPool::default_size(), const unsigned& seed=0):
+    _model{model}, _pool{num_threads}, _parameters{model.get_parameters()},
+    _buffer{new std::atomic<T>[_parameters.size()]}, _rng{seed}
+    {
+        // Recording only reads the model, and the plans never write to it
+        for (size_t i=0; i<_pool.size(); ++i)
+            _plans.push_back(std::make_unique<ExecutionPlan<T>>(model));
+        _losses.resize(_pool.size());
+    }
+    HogwildTrainer(const HogwildTrainer&) = delete;
+    HogwildTrainer(HogwildTrainer&&) = delete;
+
+    size_t num_threads() const { return _pool.size(); }
+
+    // Shared parameter storage, valid during and after training
+    const std::atomic<T>* get_buffer() const { return _buffer.get(); }
+    size_t num_parameters() const { return _parameters.size(); }
+
+    // One pass of per-sample SGD over the data. The model is read into the buffer before the pass and
+    // written back after it. Returns the mean loss per sample
+    T train_epoch(const std::vector<std::vector<T>>& inputs, const std::vector<std::vector<T>>& targets,
+        const T& learning_rate, const bool& shuffle=true)
+    {
+        assert(inputs.size() == targets.size());
+
+        std::vector<size_t> order(inputs.size());
+        std::iota(order.begin(), order.end(), static_cast<size_t>(0));
+        if (shuffle)
+            std::shuffle(order.begin(), order.end(), _rng);
+
+        load_buffer();
+        _pool.parallel_for(_plans.size(), [&](size_t worker)
+        {
+            run_worker(worker, inputs, targets, order, learning_rate);
+        });
+        store_buffer();
+
+        T rval = static_cast<T>(0);
+        for (auto& l : _losses)
+            rval += l;
+        return rval / static_cast<T>(inputs.size());
+    }
+};
+
+#endif
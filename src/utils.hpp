@@ -1,4 +1,3 @@
-
 #ifndef UTILS_HPP
 #define UTILS_HPP
 
@@ -8,6 +7,13 @@
 #include<vector>
 #include<cstdlib>
 #include<tuple>
+#include<utility>
+#include<algorithm>
+#include<string>
+#include<stdexcept>
+
+#include "mnist.hpp"
+#include "thread_pool.hpp"
 
 // Vector printout
 template <typename T>
@@ -104,6 +110,18 @@ std::tuple<
     return std::make_tuple(train_images, train_labels, test_images, test_labels);
 }
 
+// Train and test sets from the binary IDX files, as contiguous datasets for DataLoader and the Dataset
+// overloads of evaluate_model. Each set is cached in preprocessed form next to them, so later runs only map
+// the caches
+template <class T>
+std::pair<MnistDataset<T>, MnistDataset<T>> get_mnist_idx_data(const std::string& dir="data/mnist/")
+{
+    const std::string suffix = sizeof(T) == sizeof(float) ? ".f32.cache" : ".f64.cache";
+    return std::make_pair(
+        MnistDataset<T>::load(dir + "train-images-idx3-ubyte", dir + "train-labels-idx1-ubyte", dir + "train" + suffix),
+        MnistDataset<T>::load(dir + "t10k-images-idx3-ubyte", dir + "t10k-labels-idx1-ubyte", dir + "t10k" + suffix));
+}
+
 template <class T>
 T evaluate_model(const MLP<T>& model, const std::vector<std::vector<T>>& test_data, const std::vector<std::vector<T>>& test_labels)
 {
@@ -112,7 +130,7 @@ T evaluate_model(const MLP<T>& model, const std::vector<std::vector<T>>& test_da
     T correct = 0;
     for (size_t i=0; i<test_data.size(); ++i)
     {
-        auto prediction = model(test_data[i]);
+        auto prediction = model.predict(test_data[i]);
         auto max = std::max_element(prediction.begin(), prediction.end());
         auto max_index = std::distance(prediction.begin(), max);
         if (test_labels[i][max_index] == static_cast<T>(1))
@@ -121,5 +139,143 @@ T evaluate_model(const MLP<T>& model, const std::vector<std::vector<T>>& test_da
     return correct / static_cast<T>(test_data.size());
 }
 
+// Result of a classification pass. confusion[actual * num_classes + predicted] counts samples
+struct Evaluation
+{
+    size_t num_classes = 0;
+    size_t correct = 0;
+    size_t total = 0;
+    std::vector<size_t> confusion;
+
+    double accuracy() const { return total ? static_cast<double>(correct) / static_cast<double>(total) : 0.0; }
+    size_t count(const size_t& actual, const size_t& predicted) const { return confusion[actual * num_classes + predicted]; }
+
+    // Fraction of samples of the given class that were classified correctly
+    double recall(const size_t& actual) const
+    {
+        size_t row = 0;
+        for (size_t j=0; j<num_classes; ++j)
+            row += count(actual, j);
+        return row ? static_cast<double>(count(actual, actual)) / static_cast<double>(row) : 0.0;
+    }
+};
+
+// Splits [0, count) into one contiguous shard per thread. Each shard gathers batch_size rows at a time into a
+// contiguous buffer with fetch(i, dst), which returns the class of sample i, and runs them through a packed
+// model such as PackedMLP. Shard results are merged at the end, so the result does not depend on the thread count.
+// Throws if a class is not below the model's output count. Pool tasks must not throw, so a shard stops at its
+// first bad sample and the error is raised once the loop has joined
+template <class Packed, class Fetch>
+Evaluation evaluate_batched(const Packed& packed, const size_t& count, const Fetch& fetch, ThreadPool& pool, const size_t& batch_size)
+{
+    using V = typename Packed::value_type;
+    assert(batch_size > 0);
+
+    const size_t cols = packed.get_sizes().front();
+    const size_t num_classes = packed.get_sizes().back();
+    const size_t shards = pool.size();
+    std::vector<Evaluation> results(shards);
+    std::vector<size_t> bad_sample(shards, count);
+    std::vector<size_t> bad_label(shards, 0);
+
+    pool.parallel_for(shards, [&](size_t shard)
+    {
+        Evaluation& result = results[shard];
+        result.num_classes = num_classes;
+        result.confusion.assign(num_classes * num_classes, 0);
+
+        std::vector<V> inputs(batch_size * cols);
+        std::vector<size_t> labels(batch_size);
+        typename Packed::workspace_type workspace;
+
+        const size_t end = (shard + 1) * count / shards;
+        for (size_t start=shard * count / shards; start<end; start+=batch_size)
+        {
+            const size_t n = std::min(batch_size, end - start);
+            for (size_t b=0; b<n; ++b)
+            {
+                labels[b] = fetch(start + b, inputs.data() + b * cols);
+                if (labels[b] >= num_classes)
+                {
+                    bad_sample[shard] = start + b;
+                    bad_label[shard] = labels[b];
+                    return;
+                }
+            }
+
+            const V* outputs = packed.forward(inputs.data(), n, workspace);
+            for (size_t b=0; b<n; ++b)
+            {
+                const V* row = outputs + b * num_classes;
+                const size_t predicted = std::max_element(row, row + num_classes) - row;
+                ++result.confusion[labels[b] * num_classes + predicted];
+                result.correct += (predicted == labels[b]);
+            }
+            result.total += n;
+        }
+    });
+
+    for (size_t s=0; s<shards; ++s)
+        if (bad_sample[s] < count)
+            throw std::runtime_error("Label " + std::to_string(bad_label[s]) + " of sample " + std::to_string(bad_sample[s])
+                    + " is not below the model's " + std::to_string(num_classes) + " outputs.");
+
+    Evaluation rval = results.front();
+    for (size_t s=1; s<shards; ++s)
+    {
+        rval.correct += results[s].correct;
+        rval.total += results[s].total;
+        for (size_t k=0; k<rval.confusion.size(); ++k)
+            rval.confusion[k] += results[s].confusion[k];
+    }
+    return rval;
+}
+
+// Packed model over one-hot labelled rows, converting to the model's value type as needed
+template <class Packed, class T>
+Evaluation evaluate_packed(const Packed& packed, const std::vector<std::vector<T>>& test_data, const std::vector<std::vector<T>>& test_labels,
+    ThreadPool& pool, const size_t& batch_size=64)
+{
+    assert(test_data.size() == test_labels.size());
+
+    // Rows are copied straight into the batch buffer, so a short or long one would misalign the batch
+    const size_t cols = packed.get_sizes().front();
+    for (size_t i=0; i<test_data.size(); ++i)
+        if (test_data[i].size() != cols)
+            throw std::runtime_error("Row " + std::to_string(i) + " has " + std::to_string(test_data[i].size())
+                + " values, the model takes " + std::to_string(cols) + ".");
+
+    return evaluate_batched(packed, test_data.size(), [&](size_t i, typename Packed::value_type* dst)
+    {
+        std::copy(test_data[i].begin(), test_data[i].end(), dst);
+        return static_cast<size_t>(std::max_element(test_labels[i].begin(), test_labels[i].end()) - test_labels[i].begin());
+    }, pool, batch_size);
+}
+
+// As above, straight from a Dataset such as MnistDataset or IdxStream
+template <class Packed>
+Evaluation evaluate_packed(const Packed& packed, const Dataset<typename Packed::value_type>& dataset, ThreadPool& pool, const size_t& batch_size=64)
+{
+    return evaluate_batched(packed, dataset.size(), [&](size_t i, typename Packed::value_type* dst)
+    {
+        dataset.copy_row(i, dst);
+        return dataset.label(i);
+    }, pool, batch_size);
+}
+
+// Parallel batched counterpart of evaluate_model, over a PackedMLP snapshot of the model
+template <class T>
+Evaluation evaluate_model(const MLP<T>& model, const std::vector<std::vector<T>>& test_data, const std::vector<std::vector<T>>& test_labels,
+    ThreadPool& pool, const size_t& batch_size=64)
+{
+    return evaluate_packed(PackedMLP<T>(model), test_data, test_labels, pool, batch_size);
+}
+
+template <class T>
+Evaluation evaluate_model(const MLP<T>& model, const Dataset<T>& dataset, ThreadPool& pool, const size_t& batch_size=64)
+{
+    return evaluate_packed(PackedMLP<T>(model), dataset, pool, batch_size);
+}
+
 
 #endif
\ No newline at end of file
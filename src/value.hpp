@@ -6,8 +6,14 @@
 #include<vector>
 #include<utility>
 #include<functional>
-#include<set>
 #include<memory>
+#include<atomic>
+#include<assert.h>
+
+#include "profiler.hpp"
+#include "kernels.hpp"
+#include "expression.hpp"
+#include "thread_pool.hpp"
 
 const std::function<void()> do_nothing = [](){return;};
 
@@ -15,6 +21,72 @@ const std::function<void()> do_nothing = [](){return;};
 template<class T> class _Value;
 template<class T> class Value;
 
+// Thread-local switch for gradient tracking. While disabled, new nodes record no parents or backward closures
+class GradMode
+{
+private:
+    static bool& enabled()
+    {
+        static thread_local bool _enabled = true;
+        return _enabled;
+    }
+
+public:
+    static bool is_enabled() { return enabled(); }
+    static void set_enabled(const bool& value) { enabled() = value; }
+};
+
+// Scoped no-grad mode, restores the previous mode on exit
+class NoGradGuard
+{
+private:
+    bool _prev;
+
+public:
+    NoGradGuard(): _prev{GradMode::is_enabled()} { GradMode::set_enabled(false); }
+    ~NoGradGuard() { GradMode::set_enabled(_prev); }
+
+    NoGradGuard(const NoGradGuard&) = delete;
+    NoGradGuard(NoGradGuard&&) = delete;
+    NoGradGuard& operator=(const NoGradGuard&) = delete;
+    NoGradGuard& operator=(NoGradGuard&&) = delete;
+};
+
+// Scoped grad mode, for code that must build a graph whatever mode it is called under
+class EnableGradGuard
+{
+private:
+    bool _prev;
+
+public:
+    EnableGradGuard(): _prev{GradMode::is_enabled()} { GradMode::set_enabled(true); }
+    ~EnableGradGuard() { GradMode::set_enabled(_prev); }
+
+    EnableGradGuard(const EnableGradGuard&) = delete;
+    EnableGradGuard(EnableGradGuard&&) = delete;
+    EnableGradGuard& operator=(const EnableGradGuard&) = delete;
+    EnableGradGuard& operator=(EnableGradGuard&&) = delete;
+};
+
+// Kind of operation that made a node, for graph passes such as optimize_graph(). Ops whose backward depends
+// only on the parents' values are told apart from those that also hold values of their own (pow, fused, the
+// plain-input affine) or reach nodes that are not their parents (segment)
+enum class NodeOp : unsigned char
+{
+    leaf,
+    add,
+    sub,
+    mul,
+    relu,
+    affine,
+    pow,
+    affine_plain,
+    fused,
+    segment,
+    loss,
+    identity
+};
+
 // A "Hidden" value class which can only be heap allocated. Will be accessed through the proxy class
 
 template <class T>
@@ -22,8 +94,7 @@ class _Value
 {
     template <class C> friend class Value;
 
-    template <class C>
-    friend std::ostream& operator<<(std::ostream& os, _Value<C>& val)
+    friend std::ostream& operator<<(std::ostream& os, _Value<T>& val)
     {
         os << "Value(" << val.get_data() << ", " << val.get_grad() << ")";
         return os;
@@ -32,17 +103,82 @@ class _Value
 private:
     T _data{static_cast<T>(0)};
     T _grad{static_cast<T>(0)};
+    // Storage in use: the members above, or slots of an external parameter buffer for views
+    T* _data_ptr{&_data};
+    T* _grad_ptr{&_grad};
     std::vector<std::shared_ptr<_Value<T>>> _parents;
     std::function<void()> _backward = do_nothing;
+    size_t _mark{0};
+    std::vector<_Value<T>*> _topo;
+    NodeOp _op{NodeOp::leaf};
+    bool _requires_grad{true};
+
+    // Shared by all threads, so traversals on different threads never reuse an epoch. The marks themselves
+    // are plain per-node fields, so graphs that share nodes must not be traversed concurrently
+    static size_t next_epoch()
+    {
+        static std::atomic<size_t> epoch{0};
+        return epoch.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Iterative post-order DFS from root, appending the nodes not yet marked with epoch to order
+    static void visit(_Value<T>* root, const size_t& epoch, std::vector<_Value<T>*>& order)
+    {
+        if (root->_mark == epoch)
+            return;
+
+        static thread_local std::vector<std::pair<_Value<T>*, size_t>> stack;
+        stack.clear();
+
+        root->_mark = epoch;
+        stack.push_back({root, 0});
+        while (!stack.empty())
+        {
+            auto& top = stack.back();
+            _Value<T>* node = top.first;
+            if (top.second < node->_parents.size())
+            {
+                _Value<T>* par_ptr = node->_parents[top.second++].get();
+                if (par_ptr->_mark != epoch)
+                {
+                    par_ptr->_mark = epoch;
+                    stack.push_back({par_ptr, 0});
+                }
+            }
+            else
+            {
+                order.push_back(node);
+                stack.pop_back();
+            }
+        }
+    }
+
+protected:
+    _Value(T* data, T* grad): _data_ptr{data}, _grad_ptr{grad} {}
 
 public:
-    _Value(const T& data, const std::vector<std::shared_ptr<_Value<T>>>& parents):
-    _data{data}, _parents{parents}
+    _Value(const T& data, std::vector<std::shared_ptr<_Value<T>>> parents):
+    _data{data}, _parents{std::move(parents)}
     {}
 
     // Constructor and destructor
     _Value(const T& data): _data{data} {}
-    ~_Value() = default;
+
+    // Releasing the parents as members would destroy a long chain recursively, a few frames per node, and
+    // overflow the stack. Parents this node owns alone are unlinked onto a local list instead and destroyed
+    // once they have no parents of their own
+    ~_Value()
+    {
+        std::vector<std::shared_ptr<_Value<T>>> pending = std::move(_parents);
+        while (!pending.empty())
+        {
+            std::shared_ptr<_Value<T>> node = std::move(pending.back());
+            pending.pop_back();
+            if (node.use_count() == 1)
+                for (auto& p : node->_parents)
+                    pending.push_back(std::move(p));
+        }
+    }
 
     // Copy and move constructors
     _Value(const _Value&) = delete;
@@ -53,75 +189,269 @@ public:
     _Value<T>& operator=(_Value<T>&& other) = delete;
 
     // Getters (Note reference return type however)
-    const T& get_data() const { return _data; }
-    const T& get_grad() const { return _grad; }
-    T& get_data() { return _data; }
-    T& get_grad() { return _grad; }
+    const T& get_data() const { return *_data_ptr; }
+    const T& get_grad() const { return *_grad_ptr; }
+    T& get_data() { return *_data_ptr; }
+    T& get_grad() { return *_grad_ptr; }
     const std::vector<std::shared_ptr<_Value<T>>>& get_parent_ptrs() const { return _parents; }
+    NodeOp get_op() const { return _op; }
+    bool requires_grad() const { return _requires_grad; }
 
     // Setters
-    void zero_grad() { _grad = static_cast<T>(0); }
+    void zero_grad() { *_grad_ptr = static_cast<T>(0); }
     void zero_grad_all()
     {
-        auto order = build_topo();
+        const auto& order = build_topo();
         for (auto n=order.rbegin(); n!=order.rend(); ++n)
             (*n)->zero_grad();
     }
     void set_backward(const std::function<void()>& func) { _backward = func; }
 
-    // Topological sort
-    std::vector<_Value<T>*> build_topo()
+    // Rewrites for graph passes. They change the parents, so any topological order cached on this node or
+    // on nodes above it must be dropped with clear_topo()
+    void clear_topo() { _topo.clear(); _topo.shrink_to_fit(); }
+
+    // Becomes a constant leaf with its current value, releasing its parents and backward closure
+    void fold()
     {
-        std::vector<_Value<T>*> rval;
-        std::set<_Value<T>*> visited;
+        _parents.clear();
+        _parents.shrink_to_fit();
+        _backward = do_nothing;
+        _op = NodeOp::leaf;
+        _requires_grad = false;
+    }
 
-        // Build hidden function in this scope
-        std::function<void(_Value<T>*, std::set<_Value<T>*>&, std::vector<_Value<T>*>&)> _build_topo;
-        _build_topo = [&_build_topo](_Value<T>* node, std::set<_Value<T>*>& visited, std::vector<_Value<T>*>& order)
-        {
-            if (visited.find(node) != visited.end())
-                return;
+    // Becomes a pass-through of other, which has the same value and the same dependence on the leaves
+    void merge_into(const std::shared_ptr<_Value<T>>& other)
+    {
+        _Value<T>* other_ptr = other.get();
+        _Value<T>* this_ptr = this;
+        _parents = {other,};
+        _backward = [=](){ other_ptr->get_grad() += this_ptr->get_grad(); };
+        _op = NodeOp::identity;
+    }
 
-            visited.insert(node);
-            for (auto& par_ptr : node->get_parent_ptrs())
-                _build_topo(par_ptr.get(), visited, order);
-            order.push_back(node);
-        };
+    // Topological sort. Iterative post-order DFS; visits are marked with a per-sort epoch rather than a set,
+    // so it must not run concurrently with another traversal reaching the same nodes, such as the backward
+    // of a second loss built on the same parameters. Disjoint graphs may be sorted on different threads
+    // The order is cached, which holds as long as the parents below the node do not change. Only graph
+    // rewrites such as optimize_graph() change them, and they must call clear_topo() on every node they
+    // reach; see the restriction on graphs sharing nodes stated there. backward() drops the cache once it
+    // has swept, since it holds a pointer per node for as long as the root lives
+    const std::vector<_Value<T>*>& build_topo()
+    {
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::build_topo);
+        if (!_topo.empty())
+            return _topo;
 
-        _build_topo(this, visited, rval);
-        return rval;
+        visit(this, next_epoch(), _topo);
+        return _topo;
     }
 
-    // Backpropagation
-    void backward()
+    // One order for the union of the graphs below roots, each shared node appearing once. Not cached,
+    // since it belongs to no single node; the result is valid until the next call on this thread
+    static const std::vector<_Value<T>*>& build_topo(const std::vector<_Value<T>*>& roots)
     {
-        auto order = build_topo();
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::build_topo);
+        static thread_local std::vector<_Value<T>*> order;
+        order.clear();
+
+        const size_t epoch = next_epoch();
+        for (auto r : roots)
+            visit(r, epoch, order);
+        return order;
+    }
 
-        // Set dx/dx=1
-        _grad = static_cast<T>(1);
+    // Backpropagation of the sum of roots, in one sweep over the combined order. Each root's grad is seeded
+    // with += 1, so one that already holds a gradient, such as a parameter, keeps it
+    static void backward(const std::vector<_Value<T>*>& roots)
+    {
+        const auto& order = build_topo(roots);
+
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::backward);
+        for (auto r : roots)
+            *r->_grad_ptr += static_cast<T>(1);
         for (auto n=order.rbegin(); n!=order.rend(); ++n)
             (*n)->_backward();
     }
 
+    // Backpropagation
+    void backward()
+    {
+        const auto& order = build_topo();
+
+        {
+            CPP_GRAD_PROFILE_SCOPE(ProfRegion::backward);
+            // Set dx/dx=1
+            *_grad_ptr = static_cast<T>(1);
+            for (auto n=order.rbegin(); n!=order.rend(); ++n)
+                (*n)->_backward();
+        }
+        clear_topo();
+    }
+
+    // Parent updates a thread must get from one wavefront for splitting it across the pool to pay for the
+    // fork-join and for building the schedule, which costs about as much as a sequential sweep
+    static constexpr size_t min_parallel_work = 65536;
+
+    // As above, running independent closures on pool. Nodes are grouped into wavefronts: a node goes in the
+    // first group after those of its consumers, whose writes make its grad final, and after those of every
+    // node that wrote to one of its parents before it in the sequential order. Closures in one group then
+    // share no parents and run concurrently without races, and every grad receives its contributions in
+    // the sequential order, so the results are bit-identical to the sequential sweep for any pool size.
+    // This relies on closures writing only their parents' grads; segment nodes, which also write the
+    // parameters they recompute through, run in a group of their own.
+    //
+    // Nodes sharing a parent never share a group, so graphs whose nodes all read the same inputs, like the
+    // neurons of a layer or samples sharing parameters, give many narrow groups. The pool is only used if the
+    // groups average at least min_parallel_work parent updates per thread, and then only for groups that
+    // wide, the rest running inline. Otherwise this is the plain sequential sweep
+    static void backward(const std::vector<_Value<T>*>& roots, ThreadPool& pool)
+    {
+        const size_t threads = pool.size();
+        if (threads < 2)
+        {
+            backward(roots);
+            return;
+        }
+
+        const auto& order = build_topo(roots);
+
+        CPP_GRAD_PROFILE_SCOPE(ProfRegion::backward);
+        for (auto r : roots)
+            *r->_grad_ptr += static_cast<T>(1);
+        if (order.empty())
+            return;
+
+        // Scratch reused across calls on this thread
+        static thread_local std::vector<size_t> group, last, parents, work, begin, next;
+        static thread_local std::vector<_Value<T>*> sorted;
+        group.assign(order.size(), 0);
+        last.assign(order.size(), 0);
+        work.assign(order.size() + 1, 0);
+
+        // The marks hold each node's index while scheduling and are then restored to the epoch of the sort
+        const size_t epoch = order.front()->_mark;
+        size_t total = 0;
+        for (size_t i=0; i<order.size(); ++i)
+        {
+            order[i]->_mark = i;
+            total += order[i]->_parents.size();
+        }
+
+        // Scheduling costs about as much as a sequential sweep, so it is abandoned once there are more groups
+        // than the total work could make wide on average
+        const size_t max_groups = total / (threads * min_parallel_work);
+
+        size_t floor = 0;
+        size_t num_groups = 0;
+        bool abandoned = false;
+        for (size_t i=order.size(); i-->0;)
+        {
+            const _Value<T>* node = order[i];
+            if (node->_parents.empty())
+                continue;
+
+            if (num_groups > max_groups)
+            {
+                abandoned = true;
+                break;
+            }
+
+            const bool alone = node->_op == NodeOp::segment;
+            size_t g = std::max(alone ? num_groups : last[i], floor);
+            parents.clear();
+            for (auto& p : node->_parents)
+            {
+                parents.push_back(p->_mark);
+                g = std::max(g, last[parents.back()]);
+            }
+            ++g;
+
+            group[i] = g;
+            num_groups = std::max(num_groups, g);
+            work[g] += parents.size();
+            if (alone)
+                floor = g;
+            for (auto p : parents)
+                last[p] = g;
+        }
+
+        for (auto n : order)
+            n->_mark = epoch;
+
+        // Work of each group is counted in parent updates
+        bool any_wide = false;
+        for (size_t g=1; g<=num_groups; ++g)
+            any_wide = any_wide || work[g] >= threads * min_parallel_work;
+        if (abandoned || !any_wide)
+        {
+            for (auto n=order.rbegin(); n!=order.rend(); ++n)
+                (*n)->_backward();
+            return;
+        }
+
+        // Counting sort by group, keeping the sequential order within each
+        begin.assign(num_groups + 2, 0);
+        for (size_t i=0; i<order.size(); ++i)
+            ++begin[group[i] + 1];
+        for (size_t g=1; g<begin.size(); ++g)
+            begin[g] += begin[g-1];
+        sorted.resize(order.size());
+        next.assign(begin.begin(), begin.end() - 1);
+        for (size_t i=order.size(); i-->0;)
+            sorted[next[group[i]]++] = order[i];
+
+        // Group 0 holds the leaves, whose closures do nothing
+        for (size_t g=1; g<=num_groups; ++g)
+        {
+            _Value<T>** nodes = sorted.data() + begin[g];
+            const size_t count = begin[g+1] - begin[g];
+            if (work[g] < threads * min_parallel_work || count < 2)
+            {
+                for (size_t i=0; i<count; ++i)
+                    nodes[i]->_backward();
+                continue;
+            }
+
+            const size_t blocks = std::min(count, threads);
+            pool.parallel_for(blocks, [&](size_t b)
+            {
+                const size_t end = (b + 1) * count / blocks;
+                for (size_t i=b*count/blocks; i<end; ++i)
+                    nodes[i]->_backward();
+            });
+        }
+    }
+
     void descend_grad(const T& learning_rate)
     {
-        _data -= learning_rate * _grad;
+        *_data_ptr -= learning_rate * *_grad_ptr;
     }
 };
 
+// Leaf whose data and grad live in an external parameter buffer, which the node keeps alive
+template <class T>
+class _ValueView: public _Value<T>
+{
+private:
+    std::shared_ptr<void> _owner;
+
+public:
+    _ValueView(T* data, T* grad, std::shared_ptr<void> owner): _Value<T>(data, grad), _owner{std::move(owner)} {}
+};
+
 // Central Value class
 template <class T>
 class Value
 {
-    template <class C>
-    friend std::ostream& operator<<(std::ostream& os, const Value<C>& val)
+    friend std::ostream& operator<<(std::ostream& os, const Value<T>& val)
     {
         os << "Value(" << val.get_data() << ", " << val.get_grad() << ")";
         return os;
     }
 
-    template <class C>
-    friend Value<C> pow(const Value<C>& val,  const C& exp)
+    friend Value<T> pow(const Value<T>& val, const T& exp)
     {
         auto out = Value(std::pow(val.get_data(), exp), {val.get_ptr(),});
 
@@ -132,34 +462,400 @@ class Value
         {
             val_ptr->get_grad() += (exp * std::pow(val_ptr->get_data(), exp- static_cast<T>(1))) * out_ptr->get_grad();
         };
+        out.set_op(NodeOp::pow);
+        CPP_GRAD_PROFILE_NODE(ProfOp::pow, out.node_bytes());
         out.set_backward(_back);
 
         return out;
     }
 
-    template <class C>
-    friend Value<C> operator+(C num, const Value<C>& val) {return val + num;}
+    friend Value<T> operator+(const T& num, const Value<T>& val) {return val + num;}
 
-    template <class C>
-    friend Value<C> operator-(C num, const Value<C>& val) {return val - num;}
+    friend Value<T> operator-(const T& num, const Value<T>& val) {return num - lazy(val);}
 
-    template <class C>
-    friend Value<C> operator*(C num, const Value<C>& val) {return val * num;}
+    friend Value<T> operator*(const T& num, const Value<T>& val) {return val * num;}
 
-    template <class C>
-    friend Value<C> operator/(C num, const Value<C>& val) {return val / num;}
+    friend Value<T> operator/(const T& num, const Value<T>& val) {return num / lazy(val);}
+
+    // Fused bias + sum_i inputs[i]*weights[i] as a single node with 2N+1 parents.
+    // Accumulates in the same order as the equivalent chain of + and * nodes, unless packed says the weights
+    // are contiguous (see is_contiguous), in which case the sums run through simd_dot and simd_axpy
+    friend Value<T> affine(const std::vector<Value<T>>& inputs, const std::vector<Value<T>>& weights, const Value<T>& bias,
+        const bool& packed=false)
+    {
+        assert(inputs.size() == weights.size());
+        const size_t n = inputs.size();
+
+        // Packed weights go through the dot and axpy kernels, with the inputs gathered into a per-thread buffer
+        static thread_local std::vector<T> gathered;
+
+        T data = bias.get_data();
+        if (packed)
+        {
+            gathered.resize(n);
+            T* x = gathered.data();
+            for (size_t i=0; i<n; ++i)
+                x[i] = inputs[i].get_data();
+            data += simd_dot(x, &weights[0].get_data(), n);
+        }
+        else
+        {
+            for (size_t i=0; i<n; ++i)
+                data += inputs[i].get_data() * weights[i].get_data();
+        }
+
+        // Without gradients the node is a plain leaf, so no parent list is built
+        if (!GradMode::is_enabled())
+            return Value<T>(data, {});
+
+        std::vector<std::shared_ptr<_Value<T>>> parents;
+        parents.reserve(2*n + 1);
+        for (size_t i=0; i<n; ++i)
+            parents.push_back(inputs[i].get_ptr());
+        for (size_t i=0; i<n; ++i)
+            parents.push_back(weights[i].get_ptr());
+        parents.push_back(bias.get_ptr());
+
+        auto out = Value<T>(data, std::move(parents));
+        _Value<T>* out_ptr = out.get_ptr().get();
+
+        // Captures only what fits in std::function's inline buffer, so n is recovered from the parents
+        auto _back = [out_ptr, packed]()
+        {
+            const auto& par = out_ptr->get_parent_ptrs();
+            const size_t n = par.size() / 2;
+            const T grad = out_ptr->get_grad();
+            if (packed)
+            {
+                const T* w = &par[n]->get_data();
+                gathered.resize(n);
+                T* x = gathered.data();
+                for (size_t i=0; i<n; ++i)
+                {
+                    x[i] = par[i]->get_data();
+                    par[i]->get_grad() += w[i] * grad;
+                }
+                simd_axpy(grad, x, &par[n]->get_grad(), n);
+            }
+            else
+            {
+                for (size_t i=0; i<n; ++i)
+                {
+                    par[i]->get_grad() += par[n+i]->get_data() * grad;
+                    par[n+i]->get_grad() += par[i]->get_data() * grad;
+                }
+            }
+            par[2*n]->get_grad() += grad;
+        };
+        out.set_op(NodeOp::affine);
+        CPP_GRAD_PROFILE_NODE(ProfOp::affine, out.node_bytes());
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    // As above for plain inputs, which need no gradient and are held by the closure instead of as parents.
+    // Nodes over the same inputs, such as the neurons of a layer, can share one copy of them
+    friend Value<T> affine(const std::shared_ptr<const std::vector<T>>& inputs, const std::vector<Value<T>>& weights,
+        const Value<T>& bias, const bool& packed=false)
+    {
+        assert(inputs->size() == weights.size());
+        const size_t n = inputs->size();
+
+        T data = bias.get_data();
+        if (packed)
+            data += simd_dot(inputs->data(), &weights[0].get_data(), n);
+        else
+            for (size_t i=0; i<n; ++i)
+                data += (*inputs)[i] * weights[i].get_data();
+
+        if (!GradMode::is_enabled())
+            return Value<T>(data, {});
+
+        std::vector<std::shared_ptr<_Value<T>>> parents;
+        parents.reserve(n + 1);
+        for (size_t i=0; i<n; ++i)
+            parents.push_back(weights[i].get_ptr());
+        parents.push_back(bias.get_ptr());
+
+        auto out = Value<T>(data, std::move(parents));
+        _Value<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [out_ptr, inputs, packed]()
+        {
+            const auto& par = out_ptr->get_parent_ptrs();
+            const size_t n = inputs->size();
+            const T grad = out_ptr->get_grad();
+            if (packed)
+                simd_axpy(grad, inputs->data(), &par[0]->get_grad(), n);
+            else
+                for (size_t i=0; i<n; ++i)
+                    par[i]->get_grad() += (*inputs)[i] * grad;
+            par[n]->get_grad() += grad;
+        };
+        out.set_op(NodeOp::affine_plain);
+        CPP_GRAD_PROFILE_NODE(ProfOp::affine_plain, out.node_bytes());
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    friend Value<T> affine(const std::vector<T>& inputs, const std::vector<Value<T>>& weights, const Value<T>& bias,
+        const bool& packed=false)
+    {
+        // Without gradients no closure outlives the call, so the inputs are borrowed rather than copied
+        if (!GradMode::is_enabled())
+            return affine(std::shared_ptr<const std::vector<T>>(std::shared_ptr<void>(), &inputs), weights, bias, packed);
+        return affine(std::make_shared<const std::vector<T>>(inputs), weights, bias, packed);
+    }
+
+    // Gradient checkpointing. Runs segment on inputs without recording a graph and returns its outputs as
+    // nodes sharing one segment node, whose parents are the inputs. Backward through them runs segment again
+    // with gradients on, from fresh leaves holding the inputs' values, and pushes the outputs' grads through
+    // that temporary graph. Only the outputs are kept between forward and backward, at the cost of a second
+    // forward pass. Anything else segment reads, such as parameters, must be alive and unchanged until then
+    friend std::vector<Value<T>> checkpoint_segment(const std::vector<Value<T>>& inputs,
+        const std::function<std::vector<Value<T>>(const std::vector<Value<T>>&)>& segment)
+    {
+        if (!GradMode::is_enabled())
+            return segment(inputs);
+
+        std::vector<Value<T>> outputs;
+        {
+            NoGradGuard guard;
+            outputs = segment(inputs);
+        }
+
+        std::vector<std::shared_ptr<_Value<T>>> parents;
+        parents.reserve(inputs.size());
+        for (auto& i : inputs)
+            parents.push_back(i.get_ptr());
+        auto node = Value<T>(static_cast<T>(0), std::move(parents));
+        node.set_op(NodeOp::segment);
+        CPP_GRAD_PROFILE_NODE(ProfOp::segment, node.node_bytes());
+
+        // The outputs hold the segment node but not the other way round, so an output that was dropped
+        // before backward has expired and contributes no gradient
+        std::vector<Value<T>> rval;
+        std::vector<std::weak_ptr<_Value<T>>> out_ptrs;
+        rval.reserve(outputs.size());
+        out_ptrs.reserve(outputs.size());
+        for (auto& o : outputs)
+        {
+            rval.push_back(Value<T>(o.get_data(), {node.get_ptr(),}));
+            out_ptrs.push_back(rval.back().get_ptr());
+        }
+
+        _Value<T>* node_ptr = node.get_ptr().get();
+        auto _back = [=]()
+        {
+            std::vector<T> grads;
+            grads.reserve(out_ptrs.size());
+            for (auto& o : out_ptrs)
+            {
+                auto out = o.lock();
+                grads.push_back(out ? out->get_grad() : static_cast<T>(0));
+            }
+
+            // The recompute must build a graph even if backward is called under a NoGradGuard
+            EnableGradGuard guard;
+            const auto& par = node_ptr->get_parent_ptrs();
+            std::vector<Value<T>> leaves;
+            leaves.reserve(par.size());
+            for (auto& p : par)
+                leaves.push_back(Value<T>(p->get_data()));
+
+            // sum_j grads[j] * outputs[j], whose backward seeds each recomputed output with its grad
+            auto recomputed = segment(leaves);
+            affine(grads, recomputed, Value<T>(static_cast<T>(0))).backward();
+
+            for (size_t i=0; i<par.size(); ++i)
+                par[i]->get_grad() += leaves[i].get_grad();
+        };
+        node.set_backward(_back);
+
+        return rval;
+    }
+
+    // Backward through several roots at once, such as the losses of a batch. Gradients are those of their
+    // sum, which for graphs sharing only leaves is what backward() on each gives, but the shared nodes, like
+    // the parameters, are ordered and visited once in a single reverse sweep
+    friend void backward(const std::vector<Value<T>>& roots)
+    {
+        std::vector<_Value<T>*> ptrs;
+        ptrs.reserve(roots.size());
+        for (auto& r : roots)
+            ptrs.push_back(r.get_ptr().get());
+        _Value<T>::backward(ptrs);
+    }
+
+    // As above, on pool, with the same results; see _Value::backward
+    friend void backward(const std::vector<Value<T>>& roots, ThreadPool& pool)
+    {
+        std::vector<_Value<T>*> ptrs;
+        ptrs.reserve(roots.size());
+        for (auto& r : roots)
+            ptrs.push_back(r.get_ptr().get());
+        _Value<T>::backward(ptrs, pool);
+    }
+
+    // Sum of squared errors of outputs against target as a single node, as MLP::loss
+    friend Value<T> squared_error(const std::vector<Value<T>>& outputs, const std::vector<T>& target)
+    {
+        assert(outputs.size() == target.size());
+        const size_t n = outputs.size();
+
+        std::vector<std::shared_ptr<_Value<T>>> parents;
+        parents.reserve(n);
+        T data = static_cast<T>(0);
+        for (size_t i=0; i<n; ++i)
+        {
+            const T diff = outputs[i].get_data() - target[i];
+            data += diff * diff;
+            parents.push_back(outputs[i].get_ptr());
+        }
+
+        auto out = Value<T>(data, std::move(parents));
+        _Value<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            const auto& par = out_ptr->get_parent_ptrs();
+            const T grad = out_ptr->get_grad();
+            for (size_t i=0; i<n; ++i)
+                par[i]->get_grad() += static_cast<T>(2) * (par[i]->get_data() - target[i]) * grad;
+        };
+        out.set_op(NodeOp::loss);
+        CPP_GRAD_PROFILE_NODE(ProfOp::squared_error, out.node_bytes());
+        out.set_backward(_back);
+
+        return out;
+    }
+
+    // -log softmax(logits)[label] as a single node. The forward is a log-sum-exp shifted by the largest
+    // logit, and the backward is the closed form softmax(logits) - onehot(label)
+    friend Value<T> softmax_cross_entropy(const std::vector<Value<T>>& logits, const size_t& label)
+    {
+        assert(label < logits.size());
+        const size_t n = logits.size();
+
+        std::vector<std::shared_ptr<_Value<T>>> parents;
+        parents.reserve(n);
+        T max = logits[0].get_data();
+        for (size_t i=0; i<n; ++i)
+        {
+            max = std::max(max, logits[i].get_data());
+            parents.push_back(logits[i].get_ptr());
+        }
+        T sum = static_cast<T>(0);
+        for (size_t i=0; i<n; ++i)
+            sum += std::exp(logits[i].get_data() - max);
+
+        auto out = Value<T>(max + std::log(sum) - logits[label].get_data(), std::move(parents));
+        _Value<T>* out_ptr = out.get_ptr().get();
+
+        auto _back = [=]()
+        {
+            const auto& par = out_ptr->get_parent_ptrs();
+            const T grad = out_ptr->get_grad();
+            for (size_t i=0; i<n; ++i)
+            {
+                const T p = std::exp(par[i]->get_data() - max) / sum;
+                par[i]->get_grad() += (i == label ? p - static_cast<T>(1) : p) * grad;
+            }
+        };
+        out.set_op(NodeOp::loss);
+        CPP_GRAD_PROFILE_NODE(ProfOp::cross_entropy, out.node_bytes());
+        out.set_backward(_back);
+
+        return out;
+    }
 
 private:
     std::shared_ptr<_Value<T>> _ptr = nullptr;
 
-    Value(const T& data, const std::vector<std::shared_ptr<_Value<T>>>& parents) { _ptr = std::make_shared<_Value<T>>(data, parents); }
+    Value(const T& data, std::vector<std::shared_ptr<_Value<T>>> parents)
+    {
+        if (GradMode::is_enabled())
+            _ptr = std::make_shared<_Value<T>>(data, std::move(parents));
+        else
+        {
+            _ptr = std::make_shared<_Value<T>>(data);
+            _ptr->_requires_grad = false;
+        }
+    }
+
+    Value(std::shared_ptr<_Value<T>> ptr): _ptr{std::move(ptr)} {}
+
+    void set_op(const NodeOp& op) const { _ptr->_op = op; }
+
+    // Estimated heap use of this node: the shared block with its control block and the parent list.
+    // Backward closures too large for std::function's inline buffer are not included
+    size_t node_bytes() const
+    {
+        return sizeof(_Value<T>) + 2*sizeof(void*) + _ptr->get_parent_ptrs().capacity() * sizeof(std::shared_ptr<_Value<T>>);
+    }
 
 public:
     // Constructors and destructors
-    Value() { _ptr = std::make_shared<_Value<T>>(static_cast<T>(0)); }
-    Value(const T& data) { _ptr = std::make_shared<_Value<T>>(data); }
+    Value() { _ptr = std::make_shared<_Value<T>>(static_cast<T>(0)); CPP_GRAD_PROFILE_NODE(ProfOp::leaf, node_bytes()); }
+    Value(const T& data) { _ptr = std::make_shared<_Value<T>>(data); CPP_GRAD_PROFILE_NODE(ProfOp::leaf, node_bytes()); }
     ~Value() { _ptr = nullptr; };
 
+    // Single node for a whole expression, see expression.hpp
+    template <class E>
+    Value(const Expr<T, E>& expr)
+    {
+        const E& e = expr.self();
+        std::vector<std::shared_ptr<_Value<T>>> parents;
+        if (GradMode::is_enabled())
+        {
+            parents.reserve(E::leaves);
+            e.collect(parents);
+        }
+        *this = Value<T>(e.eval(), std::move(parents));
+
+        _Value<T>* out_ptr = get_ptr().get();
+        auto _back = [=]()
+        {
+            e.backward(out_ptr->get_grad());
+        };
+        set_op(NodeOp::fused);
+        CPP_GRAD_PROFILE_NODE(ProfOp::fused, node_bytes());
+        set_backward(_back);
+    }
+
+    // Leaf that never needs a gradient, so graph passes may fold the nodes computed from it alone
+    static Value<T> constant(const T& data)
+    {
+        Value<T> rval(data);
+        rval._ptr->_requires_grad = false;
+        return rval;
+    }
+
+    // Leaf viewing data[0] and grad[0], which must outlive it unless owner keeps them alive
+    static Value<T> view(T* data, T* grad, std::shared_ptr<void> owner=nullptr)
+    {
+        Value<T> rval(std::shared_ptr<_Value<T>>(std::make_shared<_ValueView<T>>(data, grad, std::move(owner))));
+        CPP_GRAD_PROFILE_NODE(ProfOp::view, sizeof(_ValueView<T>) + 2*sizeof(void*));
+        return rval;
+    }
+
+    // True if the values' data and grads each lie consecutively in memory, as views of consecutive
+    // ParameterBuffer slots do, so kernels can run over them as arrays starting at values[0]. Walks every
+    // value, so callers that know their layout, like Neuron, check it once rather than per use
+    static bool is_contiguous(const std::vector<Value<T>>& values)
+    {
+        if (values.empty())
+            return false;
+        const T* data = &values[0].get_data();
+        const T* grad = &values[0].get_grad();
+        for (size_t i=1; i<values.size(); ++i)
+            if (&values[i].get_data() != data + i || &values[i].get_grad() != grad + i)
+                return false;
+        return true;
+    }
+
     // Copy and move constructors
     Value(const Value& other) { _ptr = other._ptr; }
     Value(Value&& other) { _ptr = other._ptr; other._ptr = nullptr; }
@@ -173,13 +869,14 @@ public:
     const T& get_grad() const { return _ptr->get_grad(); }
     T& get_data() { return _ptr->get_data(); }
     T& get_grad() { return _ptr->get_grad(); }
-    std::vector<std::shared_ptr<_Value<T>>>& get_parent_ptrs() const { return _ptr->get_parent_ptrs(); }
+    const std::vector<std::shared_ptr<_Value<T>>>& get_parent_ptrs() const { return _ptr->get_parent_ptrs(); }
     void zero_grad() const { _ptr->zero_grad(); }
     void zero_grad_all() const { _ptr->zero_grad_all(); }
-    void set_backward(std::function<void()> func) const { _ptr->set_backward(func); }
+    void set_backward(std::function<void()> func) const { if (GradMode::is_enabled()) _ptr->set_backward(func); }
     void backward() const { _ptr->backward(); }
+    void backward(ThreadPool& pool) const { _Value<T>::backward({_ptr.get(),}, pool); }
     void descend_grad(const T& learning_rate) const { _ptr->descend_grad(learning_rate); }
-    std::vector<_Value<T>*> build_topo() const { return _ptr->build_topo(); }
+    const std::vector<_Value<T>*>& build_topo() const { return _ptr->build_topo(); }
 
     // ptr accessor
     std::shared_ptr<_Value<T>> get_ptr() const { return _ptr; }
@@ -197,6 +894,8 @@ public:
             if (this_ptr->get_data() > static_cast<T>(0))
                 this_ptr->get_grad() += out_ptr->get_grad();
         };
+        out.set_op(NodeOp::relu);
+        CPP_GRAD_PROFILE_NODE(ProfOp::relu, out.node_bytes());
         out.set_backward(_back);
 
         return out;
@@ -216,18 +915,20 @@ public:
 
         auto _back = [=]()
         {
-            this_ptr->_grad += out_ptr->_grad;
-            other_ptr->_grad += out_ptr->_grad;
+            this_ptr->get_grad() += out_ptr->get_grad();
+            other_ptr->get_grad() += out_ptr->get_grad();
         };
+        out.set_op(NodeOp::add);
+        CPP_GRAD_PROFILE_NODE(ProfOp::add, out.node_bytes());
         out.set_backward(_back);
 
         return out;
     }
 
+    // Operators with a plain number or a quotient are single fused nodes, without a leaf for the number
     Value<T> operator+(const T& other) const
     {
-        auto temp = Value<T>(other);
-        return operator+(temp);
+        return lazy(*this) + other;
     }
 
     Value<T> operator-(const Value<T>& other) const
@@ -246,6 +947,8 @@ public:
             this_ptr->get_grad() += out_ptr->get_grad();
             other_ptr->get_grad() += out_ptr->get_grad();
         };
+        out.set_op(NodeOp::sub);
+        CPP_GRAD_PROFILE_NODE(ProfOp::sub, out.node_bytes());
         out.set_backward(_back);
 
         return out;
@@ -253,8 +956,7 @@ public:
 
     Value<T> operator-(const T& other) const
     {
-        auto temp = Value<T>(other);
-        return operator-(temp);
+        return lazy(*this) - other;
     }
 
     Value<T> operator*(const Value<T>& other) const
@@ -273,6 +975,8 @@ public:
             this_ptr->get_grad() += other_ptr->get_data() * out_ptr->get_grad();
             other_ptr->get_grad() += this_ptr->get_data() * out_ptr->get_grad();
         };
+        out.set_op(NodeOp::mul);
+        CPP_GRAD_PROFILE_NODE(ProfOp::mul, out.node_bytes());
         out.set_backward(_back);
 
         return out;
@@ -280,25 +984,22 @@ public:
 
     Value<T> operator*(const T& other) const
     {
-        auto temp = Value<T>(other);
-        return operator*(temp);
+        return lazy(*this) * other;
     }
 
     Value<T> operator/(const Value<T>& other) const
     {
-        auto temp = pow(other, static_cast<T>(-1));
-        return operator*(temp);
+        return lazy(*this) / lazy(other);
     }
 
     Value<T> operator/(const T& other) const
     {
-        auto temp = Value<T>(other);
-        return operator/(temp);
+        return lazy(*this) / other;
     }
 
     Value<T> operator-()
     {
-        return operator*(static_cast<T>(-1));
+        return -lazy(*this);
     }
 
     // Comparison operators